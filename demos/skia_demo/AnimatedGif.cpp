@@ -1,4 +1,6 @@
 #include "AnimatedGif.h"
+#include "AnimationScheduler.h"
+#include <algorithm>
 #include <Windows.h>
 #include <shlwapi.h>
 
@@ -9,46 +11,46 @@
 
 void AnimatedGif::drawFrame(SkCanvas* canvas, int frameIndex)
 {
-	SkBitmap& bm = fFrames[frameIndex];
-	canvas->drawBitmap(bm, 0, 0);
+	if (fPrefetcher) {
+		// Shows the latest frame decoded so far if frameIndex is late.
+		if (const SkBitmap* bm = fPrefetcher->frameFor(fPacer.serial())) {
+			canvas->drawBitmap(*bm, 0, 0);
+		}
+		return;
+	}
+	if (fCache) {
+		if (const SkBitmap* bm = fCache->getFrame(frameIndex)) {
+			canvas->drawBitmap(*bm, 0, 0);
+		}
+		return;
+	}
+	if (const SkBitmap* bm = fFrames ? fFrames->getFrame(frameIndex) : nullptr) {
+		canvas->drawBitmap(*bm, 0, 0);
+	}
 }
-AnimatedGif::AnimatedGif(char *gifName)
-	: fFrame(0)
-	, fNextUpdate(-1)
+AnimatedGif::AnimatedGif(char *gifName, size_t frameCacheBytes, int prefetchFrames,
+	AnimationScheduler* scheduler, FrameClock* clock)
+	: fPacer(scheduler ? scheduler->clock() : clock)
 	, fTotalFrames(-1)
-	, fBaseTimeNanos(0)
+	, fCacheBudget(frameCacheBytes)
+	, fPrefetchFrames(prefetchFrames)
+	, fScheduler(scheduler)
+	, fGrantedBytes(0)
+	, fDrawnBounds(SkIRect::MakeEmpty())
 {
 	strcpy(fName, gifName);
 	initCodec();
+	if (fScheduler && fTotalFrames > 1) {
+		fPacer.start();
+		fScheduler->add(this);
+	}
 }
-bool AnimatedGif::copy_to(SkBitmap* dst, SkColorType dstColorType, const SkBitmap& src)
+AnimatedGif::~AnimatedGif()
 {
-	SkPixmap srcPM;
-	if (!src.peekPixels(&srcPM)) {
-		return false;
-	}
-
-	SkBitmap tmpDst;
-	SkImageInfo dstInfo = srcPM.info().makeColorType(dstColorType);
-	if (!tmpDst.setInfo(dstInfo)) {
-		return false;
-	}
-
-	if (!tmpDst.tryAllocPixels()) {
-		return false;
-	}
-
-	SkPixmap dstPM;
-	if (!tmpDst.peekPixels(&dstPM)) {
-		return false;
+	if (fScheduler) {
+		fScheduler->remove(this);
+		fScheduler->releaseMemory(fGrantedBytes);
 	}
-
-	if (!srcPM.readPixels(dstPM)) {
-		return false;
-	}
-
-	dst->swap(tmpDst);
-	return true;
 }
 bool AnimatedGif::initCodec() {
 	if (fCodec) {
@@ -66,18 +68,32 @@ bool AnimatedGif::initCodec() {
 	if (!fCodec) {
 		return false;
 	}
-	fFrame = 0;
 	fFrameInfos = fCodec->getFrameInfo();
 	fTotalFrames = fCodec->getFrameCount();
+	std::vector<int> durations(fFrameInfos.size());
+	for (size_t i = 0; i < fFrameInfos.size(); i++) {
+		durations[i] = fFrameInfos[i].fDuration;
+	}
+	fPacer.setDurations(durations);
 
 	//fTotalFrames = 2;
 
+	if (fScheduler && fTotalFrames > 1) {
+		// Ask for every frame (or the cache asked for); frames beyond what is granted are
+		// decoded on demand. The frame cache always holds at least two frames.
+		const SkImageInfo info = fCodec->getInfo().makeColorType(kN32_SkColorType);
+		const size_t allFrames = info.minRowBytes() * info.height() * fTotalFrames;
+		fGrantedBytes = fScheduler->acquireMemory(fCacheBudget ? std::min(fCacheBudget, allFrames) : allFrames);
+		if (fCacheBudget || fPrefetchFrames > 0 || fGrantedBytes < allFrames) {
+			fCacheBudget = std::max<size_t>(fGrantedBytes, 1);
+		}
+	}
+
 	// decode all bitmaps from gif
 	int frameIndex = 0;
-	fFrames.resize(fTotalFrames);
 	if (fTotalFrames == 1)
 	{
-		SkBitmap& bm = fFrames[0];
+		SkBitmap bm;
 
 		SkImageInfo info = fCodec->getInfo().makeColorType(kN32_SkColorType);
 		if (kPremul_SkAlphaType == info.alphaType()) {
@@ -91,6 +107,8 @@ bool AnimatedGif::initCodec() {
 		{
 		
 		}
+		fFrames.reset(new DeltaFrameStore(info));
+		fFrames->append(bm);
 
 		{
 			SkBitmap bm2;
@@ -108,42 +126,60 @@ bool AnimatedGif::initCodec() {
 			}
 		}
 	}
+	else if (fTotalFrames > 1 && fPrefetchFrames > 0)
+	{
+		// The worker starts on the first frames right away.
+		fPrefetcher.reset(new FramePrefetcher(fCodec.get(), fCodec->getInfo().makeColorType(kN32_SkColorType),
+			fPrefetchFrames, fCacheBudget, fScheduler ? fScheduler->decodeExecutor() : nullptr));
+	}
+	else if (fTotalFrames > 1 && fCacheBudget)
+	{
+		// Frames are decoded when first drawn.
+		fCache.reset(new FrameCache(fCodec.get(), fCodec->getInfo().makeColorType(kN32_SkColorType), fCacheBudget));
+	}
 	else if (fTotalFrames > 1)
 	{
+		// Frames are decoded one at a time into bm, and stored as deltas from the frame before.
+		const SkImageInfo info = fCodec->getInfo().makeColorType(kN32_SkColorType);
+		fFrames.reset(new DeltaFrameStore(info));
+		SkBitmap bm;
+		bm.allocPixels(info);
 
 		for (frameIndex = 0; frameIndex < fTotalFrames; frameIndex++)
 		{
-			SkBitmap& bm = fFrames[frameIndex];
-			if (!bm.getPixels()) {
-				const SkImageInfo info = fCodec->getInfo().makeColorType(kN32_SkColorType);
-				bm.allocPixels(info);
-
-				SkCodec::Options opts;
-				opts.fFrameIndex = frameIndex;
-				const int requiredFrame = fFrameInfos[frameIndex].fRequiredFrame;
-				if (requiredFrame != SkCodec::kNone) {
-					SkASSERT(requiredFrame >= 0
-						&& static_cast<size_t>(requiredFrame) < fFrames.size());
-					SkBitmap& requiredBitmap = fFrames[requiredFrame];
-					// For simplicity, do not try to cache old frames
-					if (requiredBitmap.getPixels() && copy_to(&bm, requiredBitmap.colorType(), requiredBitmap)) {
-						opts.fPriorFrame = requiredFrame;
-					}
-				}
-
-				if (SkCodec::kSuccess != fCodec->getPixels(info, bm.getPixels(),
-					bm.rowBytes(), &opts)) {
-					OutputDebugStringA("fCodec->getPixels failed\n");
+			SkCodec::Options opts;
+			opts.fFrameIndex = frameIndex;
+			const int requiredFrame = fFrameInfos[frameIndex].fRequiredFrame;
+			if (requiredFrame != SkCodec::kNone) {
+				SkASSERT(requiredFrame >= 0 && requiredFrame < fFrames->count());
+				const SkBitmap* requiredBitmap = fFrames->getFrame(requiredFrame);
+				if (requiredBitmap && requiredBitmap->readPixels(info, bm.getPixels(), bm.rowBytes(), 0, 0)) {
+					opts.fPriorFrame = requiredFrame;
 				}
+			} else {
+				// bm still holds the frame before.
+				bm.eraseColor(SK_ColorTRANSPARENT);
+			}
 
-				//SkCanvas tmpCavans(bm);
-				//char bufText[16] = { 0 };
-				//sprintf(bufText, "%d", frameIndex);
-				//SkPaint paint;
-				//paint.setTextSize(30);
-				//tmpCavans.drawText(bufText, strlen(bufText), 0, 30, paint);
-				
+			if (SkCodec::kSuccess != fCodec->getPixels(info, bm.getPixels(),
+				bm.rowBytes(), &opts)) {
+				OutputDebugStringA("fCodec->getPixels failed\n");
 			}
+
+			//SkCanvas tmpCavans(bm);
+			//char bufText[16] = { 0 };
+			//sprintf(bufText, "%d", frameIndex);
+			//SkPaint paint;
+			//paint.setTextSize(30);
+			//tmpCavans.drawText(bufText, strlen(bufText), 0, 30, paint);
+
+			fFrames->append(bm);
+		}
+
+		// The grant assumed every frame in full; return what the deltas saved.
+		if (fScheduler && fGrantedBytes > fFrames->usedBytes()) {
+			fScheduler->releaseMemory(fGrantedBytes - fFrames->usedBytes());
+			fGrantedBytes = fFrames->usedBytes();
 		}
 	}
 
@@ -153,49 +189,23 @@ bool AnimatedGif::onDraw(SkCanvas* canvas) {
 	if (!fCodec) {
 		return false;
 	}
-	fCurrTimeNanos = GetTickCount();
-	const double sec = (fCurrTimeNanos - fBaseTimeNanos);
-	SkMSec msec = static_cast<SkMSec>(sec);
-	this->onAnimate(msec);
-	this->drawFrame(canvas, fFrame);
+	if (fScheduler) {
+		// The scheduler has already advanced to the current frame.
+		fScheduler->drawn(this);
+	} else {
+		// Playback starts with the first draw.
+		if (!fPacer.isStarted()) {
+			fPacer.start();
+		}
+		fPacer.advance();
+	}
+	this->drawFrame(canvas, fPacer.frame());
+	SkRect drawn;
+	canvas->getTotalMatrix().mapRect(&drawn, SkRect::Make(fCodec->getInfo().bounds()));
+	drawn.roundOut(&fDrawnBounds);
 
 	if (fTotalFrames > 1)
 		return true;
 	else
 		return false;
-}
-bool AnimatedGif::onAnimate(SkMSec msec)
-{
-	if (!fCodec || fTotalFrames == 1) {
-		return false;
-	}
-
-	double secs = msec;
-	if (fNextUpdate < double(0)) {
-		// This is a sentinel that we have not done any updates yet.
-		// I'm assuming this gets called *after* onOnceBeforeDraw, so our first frame should
-		// already have been retrieved.
-		SkASSERT(fFrame == 0);
-		fNextUpdate = secs + fFrameInfos[fFrame].fDuration;
-
-		return true;
-	}
-
-	if (secs < fNextUpdate) {
-		return true;
-	}
-
-	while (secs >= fNextUpdate) {
-		// Retrieve the next frame.
-		fFrame++;
-		if (fFrame == fTotalFrames) {
-			fFrame = 0;
-		}
-
-		// Note that we loop here. This is not safe if we need to draw the intermediate frame
-		// in order to draw correctly.
-		fNextUpdate += fFrameInfos[fFrame].fDuration;
-	}
-
-	return true;
 }
\ No newline at end of file
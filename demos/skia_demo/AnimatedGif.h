@@ -5,32 +5,73 @@
 #include <SkCodec.h>
 #include <SkBitmap.h>
 #include <SkCanvas.h>
+#include "DeltaFrameStore.h"
+#include "FrameCache.h"
+#include "FramePacer.h"
+#include "FramePrefetcher.h"
 
+class AnimationScheduler;
 class AnimatedGif
 {
 private:
-	double  fBaseTimeNanos;
-	double  fCurrTimeNanos;
-
 	std::unique_ptr<SkCodec>        fCodec;
-	int                             fFrame;
-	double                          fNextUpdate;
+	// Current frame and playback timing.
+	FramePacer                      fPacer;
 	int                             fTotalFrames;
 	std::vector<SkCodec::FrameInfo> fFrameInfos;
-	std::vector<SkBitmap>           fFrames;
+	// Every frame, decoded up front.
+	std::unique_ptr<DeltaFrameStore> fFrames;
+	// Used instead of fFrames when a frame cache budget is given.
+	std::unique_ptr<FrameCache>     fCache;
+	size_t                          fCacheBudget;
+	// Used instead of both when frames are prefetched; then fCodec belongs to its worker.
+	std::unique_ptr<FramePrefetcher> fPrefetcher;
+	int                             fPrefetchFrames;
+	// Set when playback is driven by a scheduler instead of onDraw.
+	AnimationScheduler*             fScheduler;
+	size_t                          fGrantedBytes;
+	// Device bounds of the last draw.
+	SkIRect                         fDrawnBounds;
 
 	char fName[256];
 
 	void drawFrame(SkCanvas* canvas, int frameIndex);
 
-	static bool copy_to(SkBitmap* dst, SkColorType dstColorType, const SkBitmap& src);
 	bool initCodec();
-	bool onAnimate(SkMSec msec);
 
 public:
-	AnimatedGif(char *gifName);
+	// frameCacheBytes == 0 decodes every frame up front (kept as keyframes and deltas);
+	// otherwise frames are decoded on demand and at most about frameCacheBytes of them are
+	// kept.
+	// prefetchFrames > 0 decodes on a worker thread instead, that many frames ahead of
+	// playback (with a frame cache of frameCacheBytes); drawing never decodes, and frames
+	// that are not ready in time are counted by missedFrames().
+	//
+	// With a scheduler, it advances the frames and onDraw only draws them. Frames are
+	// kept within the scheduler's memory budget (decoded on demand beyond it, not counting
+	// prefetched ones), and prefetching uses its decode thread pool.
+	//
+	// Playback is timed on the scheduler's clock, else on clock (the monotonic clock if
+	// nullptr).
+	AnimatedGif(char *gifName, size_t frameCacheBytes = 0, int prefetchFrames = 0,
+		AnimationScheduler* scheduler = nullptr, FrameClock* clock = nullptr);
+	~AnimatedGif();
+
+	int missedFrames() const { return fPrefetcher ? fPrefetcher->missedFrames() : 0; }
+	// Frames skipped because they were due while an earlier one was still showing.
+	long long droppedFrames() const { return fPacer.droppedFrames(); }
 	
 	bool onDraw(SkCanvas* canvas);	
+	// Where onDraw last drew, in device pixels; empty before the first draw.
+	const SkIRect& drawnBounds() const { return fDrawnBounds; }
+
+	// For AnimationScheduler, on its clock.
+	// Advances playback to the current time and returns whether the frame changed.
+	bool advance() { return fPacer.advance() > 0; }
+	// When the next frame is due, or -1 if the image does not animate or is paused.
+	int64_t nextFrameNanos() const { return fPacer.nextFrameNanos(); }
+	void pause() { fPacer.pause(); }
+	void resume() { fPacer.resume(); }
 };
 
 #endif//__ANIMATEDGIF_H__
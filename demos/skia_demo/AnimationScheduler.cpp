@@ -0,0 +1,188 @@
+#include "AnimationScheduler.h"
+#include "AnimatedGif.h"
+#include <algorithm>
+
+AnimationScheduler* AnimationScheduler::getInstance()
+{
+	static AnimationScheduler s_inst;
+	return &s_inst;
+}
+
+AnimationScheduler::AnimationScheduler()
+	: fClock(FrameClock::Monotonic())
+	, fArmedNanos(-1)
+	, fMemoryBudget(kDefaultMemoryBudget)
+	, fMemoryUsed(0)
+{
+}
+
+void AnimationScheduler::setWakeCallback(std::function<void(int delayMs)> wake)
+{
+	fWake = std::move(wake);
+	fArmedNanos = -1;
+	this->rearm();
+}
+
+void AnimationScheduler::setInvalidateCallback(std::function<void(AnimatedGif*)> invalidate)
+{
+	fInvalidate = std::move(invalidate);
+}
+
+AnimationScheduler::Entry* AnimationScheduler::find(AnimatedGif* anim)
+{
+	for (Entry& entry : fEntries) {
+		if (entry.fAnim == anim) {
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+void AnimationScheduler::add(AnimatedGif* anim)
+{
+	if (this->find(anim)) {
+		return;
+	}
+	Entry entry;
+	entry.fAnim = anim;
+	entry.fVisible = true;
+	entry.fDrawn = false;
+	entry.fGeneration = 0;
+	fEntries.push_back(entry);
+
+	this->pushDeadline(&fEntries.back());
+	this->rearm();
+}
+
+void AnimationScheduler::remove(AnimatedGif* anim)
+{
+	// Its heap items are dropped when they come up, since it has no entry any more.
+	fEntries.erase(std::remove_if(fEntries.begin(), fEntries.end(),
+		[anim](const Entry& entry) { return entry.fAnim == anim; }), fEntries.end());
+}
+
+void AnimationScheduler::pushDeadline(Entry* entry)
+{
+	const int64_t timeNanos = entry->fAnim->nextFrameNanos();
+	if (timeNanos < 0) {
+		return;
+	}
+	Deadline deadline;
+	deadline.fTimeNanos = timeNanos;
+	deadline.fAnim = entry->fAnim;
+	deadline.fGeneration = entry->fGeneration;
+	fHeap.push_back(deadline);
+	std::push_heap(fHeap.begin(), fHeap.end(), std::greater<Deadline>());
+}
+
+bool AnimationScheduler::tick()
+{
+	const int64_t now = fClock->nowNanos();
+	fArmedNanos = -1;
+
+	bool changed = false;
+	while (!fHeap.empty() && fHeap.front().fTimeNanos <= now) {
+		const Deadline deadline = fHeap.front();
+		std::pop_heap(fHeap.begin(), fHeap.end(), std::greater<Deadline>());
+		fHeap.pop_back();
+
+		Entry* entry = this->find(deadline.fAnim);
+		if (!entry || entry->fGeneration != deadline.fGeneration || !entry->fVisible) {
+			continue;
+		}
+		if (entry->fAnim->advance()) {
+			changed = true;
+			if (fInvalidate) {
+				fInvalidate(entry->fAnim);
+			}
+		}
+		entry->fGeneration++;
+		this->pushDeadline(entry);
+	}
+
+	this->rearm();
+	return changed;
+}
+
+void AnimationScheduler::rearm()
+{
+	while (!fHeap.empty()) {
+		const Deadline& top = fHeap.front();
+		const Entry* entry = this->find(top.fAnim);
+		if (entry && entry->fGeneration == top.fGeneration && entry->fVisible) {
+			break;
+		}
+		std::pop_heap(fHeap.begin(), fHeap.end(), std::greater<Deadline>());
+		fHeap.pop_back();
+	}
+	if (fHeap.empty() || !fWake || fHeap.front().fTimeNanos == fArmedNanos) {
+		return;
+	}
+
+	fArmedNanos = fHeap.front().fTimeNanos;
+	// Rounded up: a timer that fires early would find nothing due and have to be re-armed.
+	const int64_t delay = fArmedNanos - fClock->nowNanos();
+	fWake(delay > 0 ? static_cast<int>((delay + 999999) / 1000000) : 0);
+}
+
+void AnimationScheduler::setVisible(AnimatedGif* anim, bool visible)
+{
+	Entry* entry = this->find(anim);
+	if (!entry || entry->fVisible == visible) {
+		return;
+	}
+	entry->fVisible = visible;
+	entry->fGeneration++;
+
+	if (visible) {
+		// Playback carries on from the frame it was paused on.
+		anim->resume();
+		this->pushDeadline(entry);
+	} else {
+		anim->pause();
+	}
+	this->rearm();
+}
+
+void AnimationScheduler::beginPaint()
+{
+	for (Entry& entry : fEntries) {
+		entry.fDrawn = false;
+	}
+}
+
+void AnimationScheduler::drawn(AnimatedGif* anim)
+{
+	if (Entry* entry = this->find(anim)) {
+		entry->fDrawn = true;
+	}
+}
+
+void AnimationScheduler::endPaint()
+{
+	for (size_t i = 0; i < fEntries.size(); i++) {
+		this->setVisible(fEntries[i].fAnim, fEntries[i].fDrawn);
+	}
+}
+
+SkExecutor* AnimationScheduler::decodeExecutor()
+{
+	if (!fExecutor) {
+		// One thread per core, shared by every prefetching animation.
+		fExecutor = SkExecutor::MakeThreadPool();
+	}
+	return fExecutor.get();
+}
+
+size_t AnimationScheduler::acquireMemory(size_t bytes)
+{
+	const size_t left = fMemoryBudget > fMemoryUsed ? fMemoryBudget - fMemoryUsed : 0;
+	const size_t granted = std::min(bytes, left);
+	fMemoryUsed += granted;
+	return granted;
+}
+
+void AnimationScheduler::releaseMemory(size_t bytes)
+{
+	fMemoryUsed -= std::min(bytes, fMemoryUsed);
+}
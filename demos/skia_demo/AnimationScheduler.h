@@ -0,0 +1,108 @@
+#ifndef __ANIMATIONSCHEDULER_H__
+#define __ANIMATIONSCHEDULER_H__
+
+#include <functional>
+#include <memory>
+#include <vector>
+#include <SkExecutor.h>
+#include "FrameClock.h"
+
+class AnimatedGif;
+
+// Drives every AnimatedGif in the process from one timer.
+//
+// A min-heap holds the next frame deadline of each animation; tick() advances only the
+// animations that are due and invalidates those whose frame changed, and the wake callback
+// is asked for one timer at the earliest remaining deadline. Animations that were not
+// drawn by the last paint (scrolled off-screen, or another page) are paused until they are
+// drawn again.
+//
+// The scheduler also owns what the animations share: a decode thread pool for their
+// prefetchers and a global budget for decoded frames.
+//
+// UI thread only.
+class AnimationScheduler
+{
+public:
+	static AnimationScheduler* getInstance();
+
+	// Called with the delay, in ms, until tick() should run next; replaces any earlier
+	// request. Not called while nothing is due.
+	void setWakeCallback(std::function<void(int delayMs)> wake);
+	// Called for each animation whose frame changed in tick().
+	void setInvalidateCallback(std::function<void(AnimatedGif*)> invalidate);
+
+	// Clock the animations are timed on; FrameClock::Monotonic() by default. Set it before
+	// adding any animation, e.g. to a VirtualFrameClock for tests.
+	void setClock(FrameClock* clock) { fClock = clock ? clock : FrameClock::Monotonic(); }
+	FrameClock* clock() const { return fClock; }
+
+	// Advances the due animations. Returns whether any frame changed.
+	bool tick();
+
+	// Animations drawn between beginPaint() and endPaint() (AnimatedGif::onDraw calls
+	// drawn()) are visible; the others are paused.
+	void beginPaint();
+	void drawn(AnimatedGif* anim);
+	void endPaint();
+
+	// Pauses or resumes anim regardless of painting, e.g. for a view that knows it is hidden.
+	void setVisible(AnimatedGif* anim, bool visible);
+
+	// Called by AnimatedGif for animations created with this scheduler.
+	void add(AnimatedGif* anim);
+	void remove(AnimatedGif* anim);
+
+	// Thread pool prefetchers decode on, created on first use.
+	SkExecutor* decodeExecutor();
+
+	// Global budget for decoded frames. acquireMemory() grants up to bytes of what is left.
+	void setMemoryBudget(size_t bytes) { fMemoryBudget = bytes; }
+	size_t acquireMemory(size_t bytes);
+	void releaseMemory(size_t bytes);
+
+	static const size_t kDefaultMemoryBudget = 256 * 1024 * 1024;
+
+private:
+	AnimationScheduler();
+	AnimationScheduler(const AnimationScheduler& rhs);
+	AnimationScheduler& operator= (const AnimationScheduler& rhs);
+
+	struct Entry
+	{
+		AnimatedGif* fAnim;
+		bool         fVisible;
+		bool         fDrawn;
+		// Bumped whenever the animation is rescheduled or paused, so that its older heap
+		// items are skipped instead of searched for and removed.
+		int          fGeneration;
+	};
+
+	struct Deadline
+	{
+		int64_t      fTimeNanos;
+		AnimatedGif* fAnim;
+		int          fGeneration;
+
+		bool operator>(const Deadline& other) const { return fTimeNanos > other.fTimeNanos; }
+	};
+
+	Entry* find(AnimatedGif* anim);
+	void pushDeadline(Entry* entry);
+	// Asks for a wake-up at the earliest live deadline, dropping stale ones on the way.
+	void rearm();
+
+	std::vector<Entry>          fEntries;
+	std::vector<Deadline>       fHeap;		// std::push_heap with std::greater: a min-heap.
+	FrameClock*                 fClock;
+	int64_t                     fArmedNanos;	// Deadline the wake callback was last asked for.
+
+	std::function<void(int)>          fWake;
+	std::function<void(AnimatedGif*)> fInvalidate;
+
+	std::unique_ptr<SkExecutor> fExecutor;
+	size_t                      fMemoryBudget;
+	size_t                      fMemoryUsed;
+};
+
+#endif//__ANIMATIONSCHEDULER_H__
@@ -0,0 +1,201 @@
+#include "DeltaFrameStore.h"
+#include <string.h>
+
+// Unchanged pixels between two changed ones are stored as changed unless there are at
+// least this many: a shorter skip costs more in run headers than it saves.
+static const int kMinSkip = 3;
+
+static void copy_pixels(const SkBitmap& src, SkBitmap* dst)
+{
+	const size_t rowBytes = src.info().minRowBytes();
+	for (int y = 0; y < src.height(); y++) {
+		memcpy(dst->getAddr32(0, y), src.getAddr32(0, y), rowBytes);
+	}
+}
+
+// Appends the runs turning prev into next, width pixels.
+static void encode_row(const uint32_t* prev, const uint32_t* next, int width,
+	std::vector<uint32_t>* runs)
+{
+	int x = 0;
+	while (x < width) {
+		int start = x;
+		while (x < width && prev[x] == next[x]) {
+			x++;
+		}
+		if (x > start) {
+			runs->push_back(static_cast<uint32_t>(x - start) << 1);
+		}
+		if (x == width) {
+			break;
+		}
+
+		start = x;
+		while (x < width) {
+			if (prev[x] != next[x]) {
+				x++;
+				continue;
+			}
+			int skip = x;
+			while (skip < width && skip - x < kMinSkip && prev[skip] == next[skip]) {
+				skip++;
+			}
+			if (skip == width || skip - x == kMinSkip) {
+				break;
+			}
+			x = skip;
+		}
+		runs->push_back(static_cast<uint32_t>(x - start) << 1 | 1);
+		runs->insert(runs->end(), next + start, next + x);
+	}
+}
+
+// Applies the runs of one row to dst, width pixels. Returns the runs that follow.
+static const uint32_t* apply_row(const uint32_t* runs, uint32_t* dst, int width)
+{
+	int x = 0;
+	while (x < width) {
+		const uint32_t header = *runs++;
+		const int length = static_cast<int>(header >> 1);
+		if (header & 1) {
+			memcpy(dst + x, runs, length * sizeof(uint32_t));
+			runs += length;
+		}
+		x += length;
+	}
+	return runs;
+}
+
+DeltaFrameStore::DeltaFrameStore(const SkImageInfo& info)
+	: fInfo(info)
+	, fFrameBytes(info.minRowBytes() * info.height())
+	, fKeyframeBytes(0)
+	, fDeltaBytes(0)
+	, fWorkingIndex(-1)
+{
+	SkASSERT(info.bytesPerPixel() == 4);
+}
+
+bool DeltaFrameStore::append(const SkBitmap& frame)
+{
+	if (frame.width() != fInfo.width() || frame.height() != fInfo.height()
+		|| frame.bytesPerPixel() != 4 || !frame.getPixels()) {
+		return false;
+	}
+	const int frameIndex = this->count();
+	Frame entry;
+	bool keyframe = frameIndex % kKeyframeInterval == 0;
+	if (!keyframe) {
+		// Deltas are against the frame before.
+		const SkBitmap* prev = this->getFrame(frameIndex - 1);
+		keyframe = !prev || !this->encodeDelta(*prev, frame, &entry);
+	}
+	if (keyframe) {
+		// Drop what a delta that was given up on had encoded so far.
+		entry.fDirty.setEmpty();
+		std::vector<uint32_t>().swap(entry.fRuns);
+		if (!entry.fKeyframe.tryAllocPixels(fInfo)) {
+			return false;
+		}
+		copy_pixels(frame, &entry.fKeyframe);
+		fKeyframeBytes += fFrameBytes;
+	} else {
+		copy_pixels(frame, &fWorking);
+		fWorkingIndex = frameIndex;
+		fDeltaBytes += entry.fRuns.size() * sizeof(uint32_t);
+	}
+	fFrames.push_back(std::move(entry));
+	return true;
+}
+
+bool DeltaFrameStore::encodeDelta(const SkBitmap& prev, const SkBitmap& next, Frame* frame)
+{
+	// The frame is rebuilt in the working bitmap, so there must be one.
+	if (fWorking.isNull() && !fWorking.tryAllocPixels(fInfo)) {
+		return false;
+	}
+
+	// Bounds of what changed. Whole rows are compared first, which is the common case.
+	const int width = fInfo.width();
+	int left = width, top = -1, right = 0, bottom = 0;
+	for (int y = 0; y < fInfo.height(); y++) {
+		const uint32_t* before = prev.getAddr32(0, y);
+		const uint32_t* after = next.getAddr32(0, y);
+		if (!memcmp(before, after, width * sizeof(uint32_t))) {
+			continue;
+		}
+		int first = 0;
+		while (before[first] == after[first]) {
+			first++;
+		}
+		int last = width;
+		while (before[last - 1] == after[last - 1]) {
+			last--;
+		}
+		left = first < left ? first : left;
+		right = last > right ? last : right;
+		if (top < 0) {
+			top = y;
+		}
+		bottom = y + 1;
+	}
+	if (top < 0) {
+		frame->fDirty.setEmpty();
+		return true;
+	}
+	frame->fDirty.setLTRB(left, top, right, bottom);
+
+	// Worth it only if it is well under half a keyframe.
+	const size_t maxRuns = fFrameBytes / 2 / sizeof(uint32_t);
+	for (int y = top; y < bottom; y++) {
+		encode_row(prev.getAddr32(left, y), next.getAddr32(left, y), right - left,
+			&frame->fRuns);
+		if (frame->fRuns.size() > maxRuns) {
+			return false;
+		}
+	}
+	frame->fRuns.shrink_to_fit();
+	return true;
+}
+
+void DeltaFrameStore::applyDelta(const Frame& frame)
+{
+	const uint32_t* runs = frame.fRuns.data();
+	for (int y = frame.fDirty.top(); y < frame.fDirty.bottom(); y++) {
+		runs = apply_row(runs, fWorking.getAddr32(frame.fDirty.left(), y), frame.fDirty.width());
+	}
+}
+
+const SkBitmap* DeltaFrameStore::getFrame(int frameIndex)
+{
+	if (frameIndex < 0 || frameIndex >= this->count()) {
+		return nullptr;
+	}
+	// Keyframes are drawn as they are.
+	if (!fFrames[frameIndex].fKeyframe.isNull()) {
+		return &fFrames[frameIndex].fKeyframe;
+	}
+	if (frameIndex == fWorkingIndex) {
+		return &fWorking;
+	}
+
+	int keyframe = frameIndex;
+	while (fFrames[keyframe].fKeyframe.isNull()) {
+		keyframe--;
+	}
+	// Carry on from the working frame when it is on the way.
+	if (fWorkingIndex < keyframe || fWorkingIndex > frameIndex) {
+		copy_pixels(fFrames[keyframe].fKeyframe, &fWorking);
+		fWorkingIndex = keyframe;
+	}
+	while (fWorkingIndex < frameIndex) {
+		this->applyDelta(fFrames[++fWorkingIndex]);
+	}
+	return &fWorking;
+}
+
+size_t DeltaFrameStore::usedBytes() const
+{
+	return fKeyframeBytes + fDeltaBytes + (fWorking.isNull() ? 0 : fFrameBytes)
+		+ fFrames.size() * sizeof(Frame);
+}
@@ -0,0 +1,63 @@
+#ifndef __DELTAFRAMESTORE_H__
+#define __DELTAFRAMESTORE_H__
+
+#include <stdint.h>
+#include <vector>
+#include <SkBitmap.h>
+
+// Every composited frame of an animation, held compactly.
+//
+// Consecutive frames usually differ only inside the rect the later one was drawn in. So
+// every kKeyframeInterval-th frame is kept in full, and the others as a delta against the
+// frame before: the bounds of the pixels that changed, and inside them runs of unchanged
+// pixels (skipped) and changed ones (stored). A frame whose delta would not be much
+// smaller than the frame itself is kept in full as well.
+//
+// Keyframes are returned as they are; the other frames are rebuilt in one working bitmap.
+// Playing forward applies a single delta, which copies only the changed runs; seeking
+// starts over from the nearest keyframe.
+class DeltaFrameStore
+{
+public:
+	// info must be 32 bits per pixel.
+	explicit DeltaFrameStore(const SkImageInfo& info);
+
+	// Adds the next frame. Its pixels are copied.
+	bool append(const SkBitmap& frame);
+	int count() const { return static_cast<int>(fFrames.size()); }
+
+	// Returns frame frameIndex. The bitmap stays valid until the next call.
+	const SkBitmap* getFrame(int frameIndex);
+
+	// Bytes held by keyframes, deltas and the working bitmap.
+	size_t usedBytes() const;
+	// Bytes every frame held in full would take.
+	size_t rawBytes() const { return fFrames.size() * fFrameBytes; }
+
+private:
+	static const int kKeyframeInterval = 16;
+
+	struct Frame
+	{
+		SkBitmap              fKeyframe;	// Set only for keyframes.
+		SkIRect               fDirty;		// Pixels that changed from the frame before.
+		// For each row of fDirty, runs covering its width: a header (length << 1, | 1 if
+		// changed) followed, for changed runs, by the new pixels.
+		std::vector<uint32_t> fRuns;
+	};
+
+	// Encodes prev -> next into frame. Fails if the delta is too big to be worth it.
+	bool encodeDelta(const SkBitmap& prev, const SkBitmap& next, Frame* frame);
+	void applyDelta(const Frame& frame);
+
+	SkImageInfo        fInfo;
+	size_t             fFrameBytes;
+	std::vector<Frame> fFrames;
+	size_t             fKeyframeBytes;
+	size_t             fDeltaBytes;
+	// Allocated with the first delta.
+	SkBitmap           fWorking;
+	int                fWorkingIndex;
+};
+
+#endif//__DELTAFRAMESTORE_H__
@@ -0,0 +1,135 @@
+#include "FrameCache.h"
+#include <Windows.h>
+
+FrameCache::FrameCache(SkCodec* codec, const SkImageInfo& info, size_t budgetBytes)
+	: fCodec(codec)
+	, fInfo(info)
+	, fFrameBytes(info.minRowBytes() * info.height())
+	, fMaxCount(2)
+	, fCachedCount(0)
+{
+	if (fFrameBytes && budgetBytes / fFrameBytes > 2) {
+		fMaxCount = static_cast<int>(budgetBytes / fFrameBytes);
+	}
+
+	fFrameInfos = fCodec->getFrameInfo();
+	fEntries.resize(fFrameInfos.size());
+	for (size_t i = 0; i < fEntries.size(); i++) {
+		fEntries[i].fCheckpoint = fFrameInfos[i].fRequiredFrame == SkCodec::kNone
+			|| i % kCheckpointInterval == 0;
+		fEntries[i].fCached = false;
+	}
+}
+
+const SkBitmap* FrameCache::getFrame(int frameIndex)
+{
+	if (frameIndex < 0 || frameIndex >= static_cast<int>(fEntries.size())) {
+		return nullptr;
+	}
+
+	// Walk back the required frames to the nearest cached one, or to a frame that needs
+	// none, then decode forward from there.
+	std::vector<int> chain;
+	int prior = SkCodec::kNone;
+	for (int frame = frameIndex; frame != SkCodec::kNone; frame = fFrameInfos[frame].fRequiredFrame) {
+		if (fEntries[frame].fCached) {
+			prior = frame;
+			break;
+		}
+		chain.push_back(frame);
+	}
+
+	for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+		if (!this->decodeFrame(*it, prior)) {
+			return nullptr;
+		}
+		prior = *it;
+	}
+
+	this->touch(frameIndex);
+	return &fEntries[frameIndex].fBitmap;
+}
+
+bool FrameCache::decodeFrame(int frameIndex, int priorFrame)
+{
+	this->makeRoom(frameIndex, priorFrame);
+
+	Entry& entry = fEntries[frameIndex];
+	if (!fSpare.isNull()) {
+		entry.fBitmap.swap(fSpare);
+		fSpare.reset();
+	} else if (!entry.fBitmap.tryAllocPixels(fInfo)) {
+		return false;
+	}
+
+	SkCodec::Options opts;
+	opts.fFrameIndex = frameIndex;
+	if (priorFrame != SkCodec::kNone) {
+		const SkBitmap& prior = fEntries[priorFrame].fBitmap;
+		if (prior.readPixels(fInfo, entry.fBitmap.getPixels(), entry.fBitmap.rowBytes(), 0, 0)) {
+			opts.fPriorFrame = priorFrame;
+		}
+	}
+
+	const SkCodec::Result result = fCodec->getPixels(fInfo, entry.fBitmap.getPixels(),
+		entry.fBitmap.rowBytes(), &opts);
+	if (SkCodec::kSuccess != result && SkCodec::kIncompleteInput != result) {
+		OutputDebugStringA("FrameCache: getPixels failed\n");
+		fSpare.swap(entry.fBitmap);
+		entry.fBitmap.reset();
+		return false;
+	}
+
+	this->cacheFrame(frameIndex);
+	return true;
+}
+
+void FrameCache::cacheFrame(int frameIndex)
+{
+	Entry& entry = fEntries[frameIndex];
+	entry.fCached = true;
+	fLru.push_front(frameIndex);
+	entry.fLru = fLru.begin();
+	fCachedCount++;
+}
+
+void FrameCache::touch(int frameIndex)
+{
+	Entry& entry = fEntries[frameIndex];
+	SkASSERT(entry.fCached);
+	fLru.splice(fLru.begin(), fLru, entry.fLru);
+}
+
+void FrameCache::makeRoom(int keep, int prior)
+{
+	while (fCachedCount >= fMaxCount) {
+		// Least recently used first, checkpoints only when nothing else can go.
+		int victim = SkCodec::kNone;
+		int checkpointVictim = SkCodec::kNone;
+		for (auto it = fLru.rbegin(); it != fLru.rend(); ++it) {
+			if (*it == keep || *it == prior) {
+				continue;
+			}
+			if (!fEntries[*it].fCheckpoint) {
+				victim = *it;
+				break;
+			}
+			if (checkpointVictim == SkCodec::kNone) {
+				checkpointVictim = *it;
+			}
+		}
+		if (victim == SkCodec::kNone) {
+			victim = checkpointVictim;
+		}
+		if (victim == SkCodec::kNone) {
+			return;
+		}
+
+		Entry& entry = fEntries[victim];
+		entry.fCached = false;
+		fLru.erase(entry.fLru);
+		fSpare.swap(entry.fBitmap);
+		entry.fBitmap.reset();
+		fCachedCount--;
+	}
+}
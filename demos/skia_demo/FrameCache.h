@@ -0,0 +1,58 @@
+#ifndef __FRAMECACHE_H__
+#define __FRAMECACHE_H__
+
+#include <list>
+#include <vector>
+#include <SkCodec.h>
+#include <SkBitmap.h>
+
+// Composited frames of an animation, kept within a byte budget.
+//
+// Frames are evicted least recently used first. Checkpoints (frames that need no earlier
+// frame, and every kCheckpointInterval-th frame) are evicted only when nothing else is
+// left, so an evicted frame is rebuilt by decoding forward from the nearest cached frame
+// of its required-frame chain.
+class FrameCache
+{
+public:
+	// codec must outlive the cache. The budget always holds at least two frames: the one
+	// being decoded and the one it is drawn over.
+	FrameCache(SkCodec* codec, const SkImageInfo& info, size_t budgetBytes);
+
+	// Returns frame frameIndex, decoding it if it is not cached. The bitmap stays valid
+	// until the next call.
+	const SkBitmap* getFrame(int frameIndex);
+
+	size_t usedBytes() const { return fCachedCount * fFrameBytes; }
+
+private:
+	static const int kCheckpointInterval = 8;
+
+	struct Entry
+	{
+		SkBitmap             fBitmap;
+		bool                 fCheckpoint;
+		bool                 fCached;
+		std::list<int>::iterator fLru;
+	};
+
+	bool decodeFrame(int frameIndex, int priorFrame);
+	void cacheFrame(int frameIndex);
+	void touch(int frameIndex);
+	// Evicts frames until one more fits, never keep or prior.
+	void makeRoom(int keep, int prior);
+
+	SkCodec*                        fCodec;
+	SkImageInfo                     fInfo;
+	size_t                          fFrameBytes;
+	int                             fMaxCount;
+	int                             fCachedCount;
+	std::vector<SkCodec::FrameInfo> fFrameInfos;
+	std::vector<Entry>              fEntries;
+	// Most recently used first.
+	std::list<int>                  fLru;
+	// Pixels of the last evicted frame, reused for the next one decoded.
+	SkBitmap                        fSpare;
+};
+
+#endif//__FRAMECACHE_H__
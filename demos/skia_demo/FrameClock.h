@@ -0,0 +1,55 @@
+#ifndef __FRAMECLOCK_H__
+#define __FRAMECLOCK_H__
+
+#include <stdint.h>
+#include <chrono>
+
+// Time source for animation playback, in nanoseconds. Only differences between readings
+// mean anything.
+class FrameClock
+{
+public:
+	virtual ~FrameClock() {}
+
+	virtual int64_t nowNanos() = 0;
+
+	// The process-wide monotonic clock.
+	static FrameClock* Monotonic();
+};
+
+// std::chrono::steady_clock: monotonic, and QueryPerformanceCounter-based on Windows, so
+// well below GetTickCount()'s 10-16 ms granularity.
+class MonotonicFrameClock : public FrameClock
+{
+public:
+	int64_t nowNanos() override
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+};
+
+inline FrameClock* FrameClock::Monotonic()
+{
+	static MonotonicFrameClock s_clock;
+	return &s_clock;
+}
+
+// A clock that only moves when told to, for deterministic playback tests and headless
+// benchmarks.
+class VirtualFrameClock : public FrameClock
+{
+public:
+	explicit VirtualFrameClock(int64_t startNanos = 0) : fNow(startNanos) {}
+
+	int64_t nowNanos() override { return fNow; }
+
+	void setNanos(int64_t nanos) { fNow = nanos; }
+	void advanceNanos(int64_t nanos) { fNow += nanos; }
+	void advanceMs(double ms) { fNow += static_cast<int64_t>(ms * 1e6); }
+
+private:
+	int64_t fNow;
+};
+
+#endif//__FRAMECLOCK_H__
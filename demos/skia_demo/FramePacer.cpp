@@ -0,0 +1,95 @@
+#include "FramePacer.h"
+
+static const int64_t kNanosPerMs = 1000000;
+
+FramePacer::FramePacer(FrameClock* clock)
+	: fClock(clock ? clock : FrameClock::Monotonic())
+	, fLoopNanos(0)
+	, fStarted(false)
+	, fFrame(0)
+	, fSerial(0)
+	, fNextDeadline(0)
+	, fPausedAt(-1)
+	, fDropped(0)
+	, fLastLateness(0)
+{
+}
+
+void FramePacer::setDurations(const std::vector<int>& durationsMs)
+{
+	fDurations.resize(durationsMs.size());
+	fLoopNanos = 0;
+	for (size_t i = 0; i < durationsMs.size(); i++) {
+		const int ms = durationsMs[i] > kMinDurationMs ? durationsMs[i] : kMinDurationMs;
+		fDurations[i] = ms * kNanosPerMs;
+		fLoopNanos += fDurations[i];
+	}
+	fStarted = false;
+	fPausedAt = -1;
+}
+
+void FramePacer::start()
+{
+	fStarted = true;
+	fFrame = 0;
+	fSerial = 0;
+	fPausedAt = -1;
+	fDropped = 0;
+	fLastLateness = 0;
+	fNextDeadline = fDurations.empty() ? 0 : fClock->nowNanos() + fDurations[0];
+}
+
+void FramePacer::pause()
+{
+	if (fPausedAt < 0) {
+		fPausedAt = fClock->nowNanos();
+	}
+}
+
+void FramePacer::resume()
+{
+	if (fPausedAt >= 0) {
+		fNextDeadline += fClock->nowNanos() - fPausedAt;
+		fPausedAt = -1;
+	}
+}
+
+int64_t FramePacer::nextFrameNanos() const
+{
+	if (!fStarted || this->isPaused() || fDurations.size() < 2) {
+		return -1;
+	}
+	return fNextDeadline;
+}
+
+int FramePacer::advance()
+{
+	if (!fStarted || this->isPaused() || fDurations.size() < 2) {
+		return 0;
+	}
+	const int64_t now = fClock->nowNanos();
+	if (now < fNextDeadline) {
+		return 0;
+	}
+	fLastLateness = now - fNextDeadline;
+
+	// Whole loops missed (the window was hidden, the process suspended) are skipped at once
+	// and land on the same frame.
+	const int frameCount = static_cast<int>(fDurations.size());
+	long long moved = 0;
+	const int64_t loops = (now - fNextDeadline) / fLoopNanos;
+	if (loops) {
+		fNextDeadline += loops * fLoopNanos;
+		moved += loops * frameCount;
+	}
+
+	while (now >= fNextDeadline) {
+		fFrame = fFrame + 1 == frameCount ? 0 : fFrame + 1;
+		fNextDeadline += fDurations[fFrame];
+		moved++;
+	}
+
+	fSerial += moved;
+	fDropped += moved - 1;
+	return moved > 0x7fffffff ? 0x7fffffff : static_cast<int>(moved);
+}
@@ -0,0 +1,67 @@
+#ifndef __FRAMEPACER_H__
+#define __FRAMEPACER_H__
+
+#include <vector>
+#include "FrameClock.h"
+
+// Which frame of an animation is due, on a FrameClock.
+//
+// Deadlines are kept in integer nanoseconds from the start of playback, so they do not
+// drift however long the animation runs. When a frame is drawn late, playback catches up
+// by skipping the frames whose time has passed (counted as dropped) rather than slowing
+// down; when it is more than a whole loop behind, whole loops are skipped at once.
+//
+// Portable and free of Skia, so playback can be tested and benchmarked headless with a
+// VirtualFrameClock.
+class FramePacer
+{
+public:
+	// Frames shorter than this (including 0 ms ones) are shown for this long, so that an
+	// animation of them still advances.
+	static const int kMinDurationMs = 1;
+
+	explicit FramePacer(FrameClock* clock = FrameClock::Monotonic());
+
+	// durationsMs[i] is how long frame i is shown. Stops playback.
+	void setDurations(const std::vector<int>& durationsMs);
+
+	FrameClock* clock() const { return fClock; }
+
+	// Starts playback on frame 0, now.
+	void start();
+	bool isStarted() const { return fStarted; }
+
+	// Time spent paused does not count towards playback.
+	void pause();
+	void resume();
+	bool isPaused() const { return fPausedAt >= 0; }
+
+	// Moves playback to the clock's current time. Returns how many frames it moved by, 0 if
+	// the frame did not change.
+	int advance();
+
+	int frame() const { return fFrame; }
+	// Frames moved through since start(), across loops.
+	long long serial() const { return fSerial; }
+	// When the next frame is due, on the clock, or -1 if playback is not running.
+	int64_t nextFrameNanos() const;
+
+	// Frames skipped by advance() without being current after any call.
+	long long droppedFrames() const { return fDropped; }
+	// How late, in nanoseconds, the frame change found by the last advance() was.
+	int64_t lastLatenessNanos() const { return fLastLateness; }
+
+private:
+	FrameClock*          fClock;
+	std::vector<int64_t> fDurations;	// Nanoseconds.
+	int64_t              fLoopNanos;
+	bool                 fStarted;
+	int                  fFrame;
+	long long            fSerial;
+	int64_t              fNextDeadline;
+	int64_t              fPausedAt;
+	long long            fDropped;
+	int64_t              fLastLateness;
+};
+
+#endif//__FRAMEPACER_H__
@@ -0,0 +1,121 @@
+#include "FramePrefetcher.h"
+#include <thread>
+
+FramePrefetcher::FramePrefetcher(SkCodec* codec, const SkImageInfo& info, int aheadFrames, size_t cacheBytes,
+	SkExecutor* executor)
+	: fFrameCount(codec->getFrameCount())
+	, fAhead(aheadFrames > 0 ? aheadFrames : 1)
+	, fExecutor(executor)
+	// The bitmaps in flight: fAhead ready, one shown and one being decoded.
+	, fReady(fAhead + 2)
+	, fFree(fAhead + 2)
+	, fWanted(0)
+	, fStop(false)
+	, fPending(0)
+	, fCache(codec, info, cacheBytes)
+	, fNextSerial(0)
+	, fLastMissed(-1)
+	, fMissed(0)
+{
+	if (!fExecutor) {
+		fOwnExecutor = SkExecutor::MakeThreadPool(1);
+		fExecutor = fOwnExecutor.get();
+	}
+	fCurrent.fSerial = -1;
+	for (int i = 0; i < fAhead + 2; i++) {
+		SkBitmap bm;
+		if (bm.tryAllocPixels(info)) {
+			fFree.push(std::move(bm));
+		}
+	}
+	// Start on the first frames right away.
+	this->schedule();
+}
+
+FramePrefetcher::~FramePrefetcher()
+{
+	// A decode task still queued on a shared executor gets to run, and stops at once.
+	fStop.store(true, std::memory_order_release);
+	while (fPending.load(std::memory_order_acquire)) {
+		std::this_thread::yield();
+	}
+}
+
+const SkBitmap* FramePrefetcher::frameFor(long long serial)
+{
+	const bool moved = fWanted.exchange(serial, std::memory_order_acq_rel) != serial;
+
+	// Take the newest ready frame up to serial. Older ones were not shown in time and go
+	// straight back to the worker.
+	bool advanced = false;
+	while (Prefetched* next = fReady.front()) {
+		if (next->fSerial > serial) {
+			break;
+		}
+		Prefetched ready;
+		fReady.pop(&ready);
+		if (!fCurrent.fBitmap.isNull()) {
+			fFree.push(std::move(fCurrent.fBitmap));
+		}
+		fCurrent = std::move(ready);
+		advanced = true;
+	}
+	if (moved || advanced) {
+		this->schedule();
+	}
+
+	if (fCurrent.fSerial != serial && fLastMissed != serial) {
+		fLastMissed = serial;
+		fMissed++;
+	}
+	return fCurrent.fBitmap.isNull() ? nullptr : &fCurrent.fBitmap;
+}
+
+void FramePrefetcher::schedule()
+{
+	if (0 == fPending.fetch_add(1, std::memory_order_acq_rel)) {
+		fExecutor->add([this] { this->pump(); });
+	}
+}
+
+bool FramePrefetcher::canDecode()
+{
+	return (!fTarget.isNull() || fFree.front())
+		&& fNextSerial < fWanted.load(std::memory_order_acquire) + fAhead;
+}
+
+void FramePrefetcher::pump()
+{
+	int seen;
+	do {
+		seen = fPending.load(std::memory_order_acquire);
+		while (!fStop.load(std::memory_order_acquire)) {
+			// Frames the drawing thread has already moved past are skipped; the cache rebuilds
+			// whatever the next one is drawn over.
+			const long long wanted = fWanted.load(std::memory_order_acquire);
+			if (fNextSerial < wanted) {
+				fNextSerial = wanted;
+			}
+			if (!this->canDecode()) {
+				break;
+			}
+
+			if (fTarget.isNull()) {
+				fFree.pop(&fTarget);
+			}
+			const long long serial = fNextSerial++;
+			const SkBitmap* decoded = fCache.getFrame(static_cast<int>(serial % fFrameCount));
+			if (!decoded || !decoded->readPixels(fTarget.info(), fTarget.getPixels(), fTarget.rowBytes(), 0, 0)) {
+				// fTarget is kept for the next frame; the drawing thread counts this one as missed.
+				continue;
+			}
+
+			Prefetched frame;
+			frame.fSerial = serial;
+			frame.fBitmap = std::move(fTarget);
+			fTarget.reset();
+			fReady.push(std::move(frame));
+		}
+		// Calls to schedule() made while decoding mean there may be more to do.
+	} while (fPending.fetch_sub(seen, std::memory_order_acq_rel) != seen);
+}
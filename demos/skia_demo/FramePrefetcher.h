@@ -0,0 +1,78 @@
+#ifndef __FRAMEPREFETCHER_H__
+#define __FRAMEPREFETCHER_H__
+
+#include <atomic>
+#include <memory>
+#include <SkCodec.h>
+#include <SkBitmap.h>
+#include <SkExecutor.h>
+#include "FrameCache.h"
+#include "SpscQueue.h"
+
+// Decodes an animation on a worker thread, ahead of playback, so that drawing never waits
+// for the codec.
+//
+// Frames are numbered by serial: frame serial % frameCount of loop serial / frameCount.
+// The worker decodes serials in order through its own FrameCache, which follows
+// fRequiredFrame chains, and copies each into one of a fixed set of bitmaps handed to the
+// drawing thread over an SpscQueue. Shown bitmaps go back to the worker over a second one.
+//
+// Decoding runs as tasks on an executor, which many prefetchers can share. At most one task
+// of a prefetcher runs at a time, so it is the only producer of its queue.
+class FramePrefetcher
+{
+public:
+	// codec must outlive the prefetcher and is only used by its worker from now on.
+	// aheadFrames frames are decoded ahead of the one being shown; cacheBytes is the budget
+	// of the worker's frame cache. executor (one thread of its own if nullptr) must outlive
+	// the prefetcher.
+	FramePrefetcher(SkCodec* codec, const SkImageInfo& info, int aheadFrames, size_t cacheBytes,
+		SkExecutor* executor = nullptr);
+	~FramePrefetcher();
+
+	// Drawing thread only. Returns frame serial if it has been decoded; otherwise counts a
+	// miss and returns the latest frame before it, or nullptr if there is none yet. The
+	// bitmap stays valid until the next call.
+	const SkBitmap* frameFor(long long serial);
+
+	// Frames the drawing thread asked for before they were ready.
+	int missedFrames() const { return fMissed; }
+
+private:
+	struct Prefetched
+	{
+		long long fSerial;
+		SkBitmap  fBitmap;
+	};
+
+	// Queues a decode task unless one is queued or running; that one then goes on.
+	void schedule();
+	// The decode task: decodes until the worker is fAhead frames ahead or out of bitmaps.
+	void pump();
+	// Whether the worker has a bitmap to decode into and its next serial is within reach.
+	bool canDecode();
+
+	const int                 fFrameCount;
+	const int                 fAhead;
+	std::unique_ptr<SkExecutor> fOwnExecutor;
+	SkExecutor*               fExecutor;
+
+	SpscQueue<Prefetched>     fReady;		// Worker to drawing thread.
+	SpscQueue<SkBitmap>       fFree;		// Drawing thread to worker.
+	std::atomic<long long>    fWanted;		// Serial being shown.
+	std::atomic<bool>         fStop;
+	// schedule() calls not yet seen by the decode task; non-zero while one is queued or runs.
+	std::atomic<int>          fPending;
+
+	// Worker only.
+	FrameCache                fCache;
+	long long                 fNextSerial;
+	SkBitmap                  fTarget;		// The bitmap the next frame is decoded into.
+
+	// Drawing thread only.
+	Prefetched                fCurrent;
+	long long                 fLastMissed;
+	int                       fMissed;
+};
+
+#endif//__FRAMEPREFETCHER_H__
@@ -3,8 +3,11 @@
 #include "skwin\LyraWindow.h"
 
 #include "SkiaTest.h"
+#include "AnimatedGif.h"
+#include "AnimationScheduler.h"
 
 #define ID_TIMER_REDRAW  101
+#define ID_TIMER_ANIMATION  102
 
 CLeftChildWindowWnd *frame;
 CLeftChildWindowWnd::CLeftChildWindowWnd(void)
@@ -44,11 +47,39 @@ LRESULT CLeftChildWindowWnd::HandleMessage(UINT uMsg, WPARAM wParam, LPARAM lPar
 		{
 			m_pPaintWnd->Init();
 		}
+		AnimationScheduler* scheduler = AnimationScheduler::getInstance();
+		scheduler->setWakeCallback([this](int delayMs) { this->SetAnimationTimer(delayMs); });
+		scheduler->setInvalidateCallback([this](AnimatedGif* anim) {
+			// Only where the animation was last drawn is repainted; the rest of the window
+			// bitmap is still valid, so there is nothing to erase either.
+			const SkIRect& bounds = anim->drawnBounds();
+			if (bounds.isEmpty()) {
+				return;
+			}
+			SkRect local = SkRect::Make(bounds);
+			SkMatrix inverse;
+			if (m_pPaintWnd->getMatrix().invert(&inverse)) {
+				inverse.mapRect(&local);
+			}
+			m_pPaintWnd->inval(&local);
+			RECT rc = { bounds.fLeft, bounds.fTop, bounds.fRight, bounds.fBottom };
+			InvalidateRect(m_hWnd, &rc, FALSE);
+		});
 	}
 	if (uMsg == WM_DESTROY) {
 		this->KillReDrawTimer();
+		::KillTimer(m_hWnd, ID_TIMER_ANIMATION);
+		AnimationScheduler::getInstance()->setWakeCallback(nullptr);
+		AnimationScheduler::getInstance()->setInvalidateCallback(nullptr);
 		::PostQuitMessage(0L);
 	}
+	if (uMsg == WM_TIMER && wParam == ID_TIMER_ANIMATION)
+	{
+		::KillTimer(m_hWnd, ID_TIMER_ANIMATION);
+		// Invalidates the animations that advance and asks for the next timer.
+		AnimationScheduler::getInstance()->tick();
+		return 0;
+	}
 	if (uMsg == WM_TIMER)
 	{
 		m_pPaintWnd->forceInvalAll();
@@ -136,4 +167,9 @@ void CLeftChildWindowWnd::KillReDrawTimer()
 		m_hasRedrawTimer = false;
 	}
 }
+void CLeftChildWindowWnd::SetAnimationTimer(int delayMs)
+{
+	// Replaces the pending one, if any.
+	::SetTimer(m_hWnd, ID_TIMER_ANIMATION, delayMs > USER_TIMER_MINIMUM ? delayMs : USER_TIMER_MINIMUM, NULL);
+}
 
@@ -20,6 +20,8 @@ public:
 
 	void SetReDrawTimer(int elapse);
 	void KillReDrawTimer();
+	// One-shot timer that runs the animation scheduler after delayMs.
+	void SetAnimationTimer(int delayMs);
 
 protected:
 	CLyraWindow * m_pPaintWnd;
@@ -0,0 +1,79 @@
+// Headless playback simulation for FramePacer on a VirtualFrameClock: no window, no Skia.
+//
+//   g++ -std=c++11 -O2 FramePacer.cpp PacingBench.cpp -o pacing_bench && ./pacing_bench
+//
+// A render loop wakes at the pacer's deadline (plus timer slack), spends a per-frame cost
+// decoding and drawing, and sleeps until the next deadline. Reports how many frames were
+// dropped and how late frame changes were seen, for 10 ms animations at several costs.
+
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include "FramePacer.h"
+
+struct Scenario
+{
+	const char* fName;
+	double      fCostMs;		// Decode and draw time per shown frame.
+	double      fSlackMs;		// How late the timer fires after the deadline.
+	double      fStallEveryMs;	// A stall of fStallMs this often, 0 for none.
+	double      fStallMs;
+};
+
+static void run(const Scenario& scenario)
+{
+	static const int kFrames = 105;
+	static const int kFrameMs = 10;
+	static const double kRunMs = 60 * 1000;
+
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations(std::vector<int>(kFrames, kFrameMs));
+	pacer.start();
+
+	std::vector<int64_t> lateness;
+	long long shown = 0;
+	double nextStall = scenario.fStallEveryMs;
+	while (clock.nowNanos() < static_cast<int64_t>(kRunMs * 1e6)) {
+		const int64_t due = pacer.nextFrameNanos();
+		if (due > clock.nowNanos()) {
+			clock.setNanos(due);
+		}
+		clock.advanceMs(scenario.fSlackMs);
+		if (scenario.fStallEveryMs > 0 && clock.nowNanos() >= nextStall * 1e6) {
+			clock.advanceMs(scenario.fStallMs);
+			nextStall += scenario.fStallEveryMs;
+		}
+
+		if (pacer.advance()) {
+			lateness.push_back(pacer.lastLatenessNanos());
+			shown++;
+			clock.advanceMs(scenario.fCostMs);
+		}
+	}
+
+	std::sort(lateness.begin(), lateness.end());
+	const double p50 = lateness.empty() ? 0 : lateness[lateness.size() / 2] / 1e6;
+	const double p99 = lateness.empty() ? 0 : lateness[lateness.size() * 99 / 100] / 1e6;
+	const double max = lateness.empty() ? 0 : lateness.back() / 1e6;
+	printf("%-24s shown=%-6lld dropped=%-6lld late_p50_ms=%-6.2f late_p99_ms=%-6.2f late_max_ms=%.2f\n",
+		scenario.fName, shown, pacer.droppedFrames(), p50, p99, max);
+}
+
+int main()
+{
+	static const Scenario kScenarios[] = {
+		{ "ideal",                0,  0,   0,    0 },
+		{ "timer_slack_1ms",      0,  1,   0,    0 },
+		{ "cost_4ms",             4,  1,   0,    0 },
+		{ "cost_9ms",             9,  1,   0,    0 },
+		{ "cost_15ms",            15, 1,   0,    0 },
+		{ "cost_25ms",            25, 1,   0,    0 },
+		{ "stall_100ms_every_1s", 4,  1,   1000, 100 },
+		{ "stall_5s_every_20s",   4,  1,   20000, 5000 },
+	};
+	for (const Scenario& scenario : kScenarios) {
+		run(scenario);
+	}
+	return 0;
+}
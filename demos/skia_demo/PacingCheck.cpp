@@ -0,0 +1,147 @@
+// Deterministic checks of FramePacer on a VirtualFrameClock: no window, no Skia.
+//
+//   g++ -std=c++11 -Wall -Wextra FramePacer.cpp PacingCheck.cpp -o pacing_check && ./pacing_check
+//
+// Each scenario moves the clock to fixed times and checks the exact frame, serial, dropped
+// count and next deadline. Exits with 1 if any check fails.
+
+#include <stdio.h>
+#include <vector>
+#include "FramePacer.h"
+
+static int s_failures = 0;
+
+#define CHECK_EQ(actual, expected)                                                      \
+	do {                                                                                \
+		const long long a = (actual), e = (expected);                                   \
+		if (a != e) {                                                                   \
+			printf("%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, a, e); \
+			s_failures++;                                                               \
+		}                                                                               \
+	} while (0)
+
+static const int64_t kMs = 1000000;
+
+// Four frames of 10 ms: a 40 ms loop.
+static std::vector<int> four_frames()
+{
+	return std::vector<int>(4, 10);
+}
+
+static void check_on_time()
+{
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations({ 10, 20, 30 });
+	pacer.start();
+	CHECK_EQ(pacer.frame(), 0);
+	CHECK_EQ(pacer.nextFrameNanos(), 10 * kMs);
+
+	clock.setNanos(10 * kMs - 1);
+	CHECK_EQ(pacer.advance(), 0);
+	CHECK_EQ(pacer.frame(), 0);
+
+	const int64_t times[] = { 10, 30, 60, 70 };
+	const int frames[] = { 1, 2, 0, 1 };
+	const int64_t next[] = { 30, 60, 70, 90 };
+	for (int i = 0; i < 4; i++) {
+		clock.setNanos(times[i] * kMs);
+		CHECK_EQ(pacer.advance(), 1);
+		CHECK_EQ(pacer.frame(), frames[i]);
+		CHECK_EQ(pacer.serial(), i + 1);
+		CHECK_EQ(pacer.nextFrameNanos(), next[i] * kMs);
+		CHECK_EQ(pacer.lastLatenessNanos(), 0);
+	}
+	CHECK_EQ(pacer.droppedFrames(), 0);
+}
+
+static void check_one_late_frame()
+{
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations(four_frames());
+	pacer.start();
+
+	// Frame 1 was due at 10 ms and ended at 20 ms, so it is dropped.
+	clock.setNanos(25 * kMs);
+	CHECK_EQ(pacer.advance(), 2);
+	CHECK_EQ(pacer.frame(), 2);
+	CHECK_EQ(pacer.serial(), 2);
+	CHECK_EQ(pacer.droppedFrames(), 1);
+	CHECK_EQ(pacer.lastLatenessNanos(), 15 * kMs);
+	// Deadlines stay on the original schedule.
+	CHECK_EQ(pacer.nextFrameNanos(), 30 * kMs);
+
+	clock.setNanos(30 * kMs);
+	CHECK_EQ(pacer.advance(), 1);
+	CHECK_EQ(pacer.frame(), 3);
+	CHECK_EQ(pacer.droppedFrames(), 1);
+}
+
+static void check_multi_loop_stall()
+{
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations(four_frames());
+	pacer.start();
+
+	// Three whole loops and 15 ms past the first deadline: the loops are skipped at once,
+	// then frames 1 and 2 are passed through.
+	clock.setNanos(145 * kMs);
+	CHECK_EQ(pacer.advance(), 14);
+	CHECK_EQ(pacer.frame(), 2);
+	CHECK_EQ(pacer.serial(), 14);
+	CHECK_EQ(pacer.droppedFrames(), 13);
+	CHECK_EQ(pacer.lastLatenessNanos(), 135 * kMs);
+	CHECK_EQ(pacer.nextFrameNanos(), 150 * kMs);
+}
+
+static void check_pause_resume()
+{
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations(four_frames());
+	pacer.start();
+
+	clock.setNanos(5 * kMs);
+	pacer.pause();
+	CHECK_EQ(pacer.nextFrameNanos(), -1);
+	clock.setNanos(100 * kMs);
+	CHECK_EQ(pacer.advance(), 0);
+	CHECK_EQ(pacer.frame(), 0);
+
+	// The 95 ms paused do not count: frame 0 still has 5 ms to go.
+	pacer.resume();
+	CHECK_EQ(pacer.nextFrameNanos(), 105 * kMs);
+	clock.setNanos(105 * kMs - 1);
+	CHECK_EQ(pacer.advance(), 0);
+	clock.setNanos(105 * kMs);
+	CHECK_EQ(pacer.advance(), 1);
+	CHECK_EQ(pacer.frame(), 1);
+	CHECK_EQ(pacer.serial(), 1);
+	CHECK_EQ(pacer.droppedFrames(), 0);
+	CHECK_EQ(pacer.nextFrameNanos(), 115 * kMs);
+}
+
+static void check_zero_durations()
+{
+	VirtualFrameClock clock;
+	FramePacer pacer(&clock);
+	pacer.setDurations({ 0, 0 });
+	pacer.start();
+	CHECK_EQ(pacer.nextFrameNanos(), FramePacer::kMinDurationMs * kMs);
+	clock.setNanos(FramePacer::kMinDurationMs * kMs);
+	CHECK_EQ(pacer.advance(), 1);
+	CHECK_EQ(pacer.frame(), 1);
+}
+
+int main()
+{
+	check_on_time();
+	check_one_late_frame();
+	check_multi_loop_stall();
+	check_pause_resume();
+	check_zero_durations();
+	printf("%s\n", s_failures ? "FAILED" : "OK");
+	return s_failures ? 1 : 0;
+}
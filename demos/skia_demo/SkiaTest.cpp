@@ -1,6 +1,7 @@
 #include <Windows.h>
 #include "SkiaTest.h"
 #include "AnimatedGif.h"
+#include "AnimationScheduler.h"
 
 // start : ignore skia dll warnings
 #pragma warning( push )  
@@ -463,9 +464,11 @@ bool TestDrawSumPathEffect(SkCanvas* canvas) {
 }
 
 bool TestDrawGif(SkCanvas* canvas) { 
-	static AnimatedGif anim("Brain_MRI_apng_105px_100ms.png");
-	//
-	return anim.onDraw(canvas);
+	// Frames are decoded ahead on the scheduler's thread pool, and the scheduler asks for
+	// a redraw when the next one is due.
+	static AnimatedGif anim("Brain_MRI_apng_105px_100ms.png", 0, 3, AnimationScheduler::getInstance());
+	anim.onDraw(canvas);
+	return false;
 
 	//return true;
 	//return false;
@@ -553,7 +556,11 @@ void CSkiaTest::prev()
 void CSkiaTest::Draw(SkCanvas *canvas)
 {
 	DrawFuncPtr fun = ms_arrFuncs[m_iCurrentFuncIndex];
+	// Animations the test does not draw are paused until it draws them again.
+	AnimationScheduler* scheduler = AnimationScheduler::getInstance();
+	scheduler->beginPaint();
 	bool needRedraw = fun(canvas);
+	scheduler->endPaint();
 
 	if (needRedraw)
 		frame->SetReDrawTimer(20);
@@ -0,0 +1,68 @@
+#ifndef __SPSCQUEUE_H__
+#define __SPSCQUEUE_H__
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+#include <utility>
+
+// Bounded lock-free queue between exactly one producer thread and one consumer thread.
+// Items are moved in and out of slots allocated up front, so neither side ever blocks or
+// allocates.
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity)
+		: fSlots(capacity + 1)	// One slot stays empty to tell full from empty.
+		, fHead(0)
+		, fTail(0)
+	{}
+
+	// Producer only. Returns false, leaving item alone, if the queue is full.
+	bool push(T&& item)
+	{
+		const size_t tail = fTail.load(std::memory_order_relaxed);
+		const size_t next = this->advance(tail);
+		if (next == fHead.load(std::memory_order_acquire)) {
+			return false;
+		}
+		fSlots[tail] = std::move(item);
+		fTail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. The oldest item, or nullptr if the queue is empty. It stays valid
+	// until it is popped.
+	T* front()
+	{
+		const size_t head = fHead.load(std::memory_order_relaxed);
+		if (head == fTail.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &fSlots[head];
+	}
+
+	// Consumer only. Returns false if the queue is empty.
+	bool pop(T* item)
+	{
+		T* oldest = this->front();
+		if (!oldest) {
+			return false;
+		}
+		*item = std::move(*oldest);
+		fHead.store(this->advance(fHead.load(std::memory_order_relaxed)), std::memory_order_release);
+		return true;
+	}
+
+private:
+	size_t advance(size_t index) const { return index + 1 == fSlots.size() ? 0 : index + 1; }
+
+	std::vector<T>      fSlots;
+	// Written by the consumer and the producer respectively; kept on separate cache lines
+	// so the two threads do not contend for one.
+	alignas(64) std::atomic<size_t> fHead;
+	alignas(64) std::atomic<size_t> fTail;
+};
+
+#endif//__SPSCQUEUE_H__
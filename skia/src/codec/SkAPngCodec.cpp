@@ -11,6 +11,7 @@
 #include "SkColorSpace.h"
 #include "SkColorSpacePriv.h"
 #include "SkColorTable.h"
+#include "SkExecutor.h"
 #include "SkMath.h"
 #include "SkOpts.h"
 #include "SkAPngCodec.h"
@@ -18,6 +19,7 @@
 #include "SkSize.h"
 #include "SkStream.h"
 #include "SkSwizzler.h"
+#include "SkTaskGroup.h"
 #include "SkTemplates.h"
 #include "SkUtils.h"
 
@@ -26,6 +28,7 @@
 
 #include "SkAPngReader.h"
 #include "SkAPngFrameDecoder.h"
+#include "SkAPngStreamBuffer.h"
 
 // This warning triggers false postives way too often in here.
 #if defined(__GNUC__) && !defined(__clang__)
@@ -53,13 +56,17 @@ static void sk_error_fn(png_structp png_ptr, png_const_charp msg) {
 
 void sk_warning_fn(png_structp, png_const_charp msg);
 
+// acTL, fcTL and fdAT are indexed by SkAPngReader straight from the stream. They are never
+// handed to libpng, which would otherwise malloc and copy each one as an unknown chunk.
+static inline bool is_apng_tag(const void* tag) {
+	return !memcmp(tag, "acTL", 4) || !memcmp(tag, "fcTL", 4) || !memcmp(tag, "fdAT", 4);
+}
+
 #ifdef PNG_READ_UNKNOWN_CHUNKS_SUPPORTED
 static int sk_read_user_chunk(png_structp png_ptr, png_unknown_chunkp chunk) {
     SkPngChunkReader* chunkReader = (SkPngChunkReader*)png_get_user_chunk_ptr(png_ptr);
     // readChunk() returning true means continue decoding
-	// filter apng tags
-	const char * tag = (const char*)chunk->name;
-	if (!memcmp(tag, "acTL", 4) || !memcmp(tag, "acTL", 4) || !memcmp(tag, "acTL", 4))
+	if (is_apng_tag(chunk->name))
 	{
 		return 1;
 	}
@@ -176,8 +183,20 @@ static inline bool is_chunk(const png_byte* chunk, const char* tag) {
     return memcmp(chunk + 4, tag, 4) == 0;
 }
 
+// Feeds the next length bytes of stream to libpng. Memory-backed streams (SkMemoryStream,
+// SkData) are handed to libpng in place; others are copied through buffer.
 static inline bool process_data(png_structp png_ptr, png_infop info_ptr,
         SkStream* stream, void* buffer, size_t bufferSize, size_t length) {
+    const png_byte* memoryBase = (const png_byte*) stream->getMemoryBase();
+    if (memoryBase && stream->hasPosition() && stream->hasLength()) {
+        const size_t position = stream->getPosition();
+        const size_t available = std::min(length, stream->getLength() - position);
+        // Advance first: png_process_data may longjmp out.
+        stream->skip(available);
+        png_process_data(png_ptr, info_ptr, (png_bytep) memoryBase + position, available);
+        return available == length;
+    }
+
     while (length > 0) {
         const size_t bytesToProcess = std::min(bufferSize, length);
         const size_t bytesRead = stream->read(buffer, bytesToProcess);
@@ -227,6 +246,13 @@ bool AutoCleanAPng::decodeBounds() {
             return true;
         }
 
+        if (is_apng_tag(chunk + 4)) {
+            if (fStream->skip(length + 4) < length + 4) {
+                return false;
+            }
+            continue;
+        }
+
         png_process_data(fPng_ptr, fInfo_ptr, chunk, 8);
         // Process the full chunk + CRC.
         if (!process_data(fPng_ptr, fInfo_ptr, fStream, buffer, kBufferSize, length + 4)) {
@@ -712,19 +738,45 @@ void AutoCleanAPng::infoCallback(size_t idatLength) {
     this->releasePngPtrs();
 }
 
+
 SkAPngCodec::SkAPngCodec(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo,
                        std::unique_ptr<SkStream> stream, SkPngChunkReader* chunkReader,
                        void* png_ptr, void* info_ptr, int bitDepth, SkAPngReader *pAPngReader)
     : INHERITED(encodedInfo, imageInfo, std::move(stream), chunkReader, png_ptr, info_ptr, bitDepth)
 	, m_pAPngReader(pAPngReader)
-{}
+	, m_pStreamBuffer(nullptr)
+	, m_bNeedReadHeader(false)
+	, m_pIncrementalFrameDecoder(nullptr)
+	, m_sampleX(1)
+	, m_sampleY(1)
+	, m_indexOutput(false)
+	, m_transparentIndex(-1)
+	, m_paletteHasPartialAlpha(false)
+{
+	memset(m_paletteAlpha, 0, sizeof(m_paletteAlpha));
+}
 
 SkAPngCodec::~SkAPngCodec() {
+	// Frame decoders refer to m_pAPngReader.
+	m_frameDecoder.reset();
 	if (m_pAPngReader)
 		delete m_pAPngReader;
 }
 
 bool SkAPngCodec::onRewind() {
+	// Frames after the first are decoded by frame decoders which seek to their own data,
+	// so re-reading the main header here would be wasted for them. Drop the read struct
+	// and let readHeaderIfNeeded() rebuild it when frame 0 is decoded again.
+	this->destroyReadStruct();
+	m_bNeedReadHeader = true;
+	return true;
+}
+
+bool SkAPngCodec::readHeaderIfNeeded() {
+	if (!m_bNeedReadHeader) {
+		return true;
+	}
+
 	// This sets fPng_ptr and fInfo_ptr to nullptr. If read_apng_header
 	// succeeds, they will be repopulated, and if it fails, they will
 	// remain nullptr. Any future accesses to fPng_ptr and fInfo_ptr will
@@ -732,6 +784,11 @@ bool SkAPngCodec::onRewind() {
 	// to reinitialize them.
 	this->destroyReadStruct();
 
+	// Frame decoders may have moved the shared stream.
+	if (!this->stream()->rewind()) {
+		return false;
+	}
+
 	png_structp png_ptr;
 	png_infop info_ptr;
 	if (kSuccess != read_apng_header(this->stream(), fPngChunkReader.get(), nullptr,
@@ -739,26 +796,197 @@ bool SkAPngCodec::onRewind() {
 		return false;
 	}
 
-	size_t position = stream()->getPosition();
-
 	fPng_ptr = png_ptr;
 	fInfo_ptr = info_ptr;
 	fDecodedIdat = false;
+	m_bNeedReadHeader = false;
 	return true;
 }
 
+bool SkAPngCodec::isFrameDataRetained(int frameIndex) {
+	if (!m_pStreamBuffer || !m_pStreamBuffer->retainedFrom()) {
+		return true;
+	}
+	// Frame 0 is read by the main png_struct from the start of the file.
+	const SkAPngFrameContext* frame = m_pAPngReader->frameContext(frameIndex);
+	if (!frame || 0 == frameIndex) {
+		return false;
+	}
+	const std::vector<SkAPngFrameBlock>* blocks = frame->getIDATBlocks();
+	return blocks->empty() || blocks->front().blockPosition >= m_pStreamBuffer->retainedFrom();
+}
+
+void SkAPngCodec::releaseDataBefore(int frameIndex) {
+	if (!m_pStreamBuffer || frameIndex <= 0) {
+		return;
+	}
+	const SkAPngFrameContext* frame = m_pAPngReader->frameContext(frameIndex);
+	const std::vector<SkAPngFrameBlock>* blocks = frame ? frame->getIDATBlocks() : nullptr;
+	if (blocks && !blocks->empty()) {
+		m_pStreamBuffer->discardBefore(blocks->front().blockPosition);
+	}
+}
+
+SkAPngFrameDecoder* SkAPngCodec::getFrameDecoder(int frameIndex, Result* result) {
+	if (!m_pAPngReader->verifyFrame(stream(), frameIndex)) {
+		*result = kInvalidInput;
+		return nullptr;
+	}
+	if (m_frameDecoder) {
+		*result = m_frameDecoder->resetFrame(frameIndex);
+		if (kSuccess != *result) {
+			m_frameDecoder.reset();
+			return nullptr;
+		}
+		return m_frameDecoder.get();
+	}
+
+	*result = kSuccess;
+	m_frameDecoder = SkAPngFrameDecoder::MakeFrameDecoder(stream(), &m_scratchArena, result, this, frameIndex);
+	return m_frameDecoder.get();
+}
+
+// Fills rect with value bytes: zero for pixels, the clear index for palette indices.
+static void zero_rect(const SkImageInfo& dstInfo, void* pixels, size_t rowBytes, SkIRect rect,
+	uint8_t value = 0) {
+	if (!rect.intersect(SkIRect::MakeWH(dstInfo.width(), dstInfo.height()))) {
+		return;
+	}
+	const size_t bpp = dstInfo.bytesPerPixel();
+	pixels = SkTAddOffset<void>(pixels, rect.fTop * rowBytes + rect.fLeft * bpp);
+	for (int y = 0; y < rect.height(); y++) {
+		memset(pixels, value, rect.width() * bpp);
+		pixels = SkTAddOffset<void>(pixels, rowBytes);
+	}
+}
+
+SkCodec::Result SkAPngCodec::prepareFrameCanvas(const SkImageInfo& dstInfo, void* dst,
+		size_t rowBytes, const Options& options) {
+	const int index = options.fFrameIndex;
+	const SkFrame* frame = m_pAPngReader->getFrame(index);
+	if (!frame) {
+		return kInvalidParameters;
+	}
+
+	// dst holds options.fSubset (or the canvas), sampled; frame rects are mapped into it.
+	const SkIRect region = options.fSubset ? *options.fSubset : SkIRect::MakeWH(dstInfo.width(), dstInfo.height());
+	const SkImageInfo outputInfo = dstInfo.makeWH(get_scaled_dimension(region.width(), m_sampleX),
+		get_scaled_dimension(region.height(), m_sampleY));
+	const SkIRect outputBounds = SkIRect::MakeWH(outputInfo.width(), outputInfo.height());
+	auto outputRect = [&](const SkIRect& rect) {
+		return SkAPngFrameDecoder::SampledFrameRect(rect, region, m_sampleX, m_sampleY);
+	};
+	// Indices can only be cleared with a transparent palette entry.
+	auto clearRect = [&](const SkIRect& rect) {
+		if (m_indexOutput && m_transparentIndex < 0) {
+			return false;
+		}
+		zero_rect(outputInfo, dst, rowBytes, rect, this->clearIndex());
+		return true;
+	};
+
+	const int requiredFrame = frame->getRequiredFrame();
+	if (kNone == requiredFrame) {
+		// Nothing from earlier frames shows through. Only clear what the frame will not
+		// overwrite completely.
+		const bool coversCanvas = outputRect(frame->frameRect()) == outputBounds
+			&& SkCodecAnimation::Blend::kBG == frame->getBlend();
+		if (!coversCanvas && kNo_ZeroInitialized == options.fZeroInitialized
+				&& !clearRect(outputBounds)) {
+			return kUnimplemented;
+		}
+		return kSuccess;
+	}
+
+	if (kNone != options.fPriorFrame) {
+		// dst already holds fPriorFrame. It must be a frame this one can be drawn over.
+		if (options.fPriorFrame < requiredFrame || options.fPriorFrame >= index) {
+			return kInvalidParameters;
+		}
+		const SkFrame* priorFrame = m_pAPngReader->getFrame(options.fPriorFrame);
+		switch (priorFrame->getDisposalMethod()) {
+			case SkCodecAnimation::DisposalMethod::kRestorePrevious:
+				// The caller should have restored the frame before it.
+				return kInvalidParameters;
+			case SkCodecAnimation::DisposalMethod::kRestoreBGColor:
+				if (!clearRect(outputRect(priorFrame->frameRect()))) {
+					return kUnimplemented;
+				}
+				break;
+			default:
+				break;
+		}
+		return kSuccess;
+	}
+
+	// Build the required frame in dst first. Frames disposed with kRestorePrevious are
+	// never required, so restoring previous only ever means skipping them.
+	Options requiredOptions = options;
+	requiredOptions.fFrameIndex = requiredFrame;
+	requiredOptions.fPriorFrame = kNone;
+	Result result;
+	if (options.fSubset || 1 != m_sampleX || 1 != m_sampleY) {
+		// onGetPixels only decodes whole frames.
+		int rowsDecoded = 0;
+		result = this->onStartIncrementalDecode(dstInfo, dst, rowBytes, requiredOptions);
+		if (kSuccess == result) {
+			result = this->onIncrementalDecode(&rowsDecoded);
+		}
+	} else {
+		result = this->onGetPixels(dstInfo, dst, rowBytes, requiredOptions, nullptr);
+	}
+	if (kSuccess != result) {
+		return result;
+	}
+
+	const SkFrame* required = m_pAPngReader->getFrame(requiredFrame);
+	if (SkCodecAnimation::DisposalMethod::kRestoreBGColor == required->getDisposalMethod()
+			&& !clearRect(outputRect(required->frameRect()))) {
+		return kUnimplemented;
+	}
+	return kSuccess;
+}
+
 SkCodec::Result SkAPngCodec::onGetPixels(const SkImageInfo& dstInfo, void* dst,
                                         size_t rowBytes, const Options& options,
                                         int* rowsDecoded) {
+	// A full decode ends any incremental one; its frame decoder may be reset below.
+	m_pIncrementalFrameDecoder = nullptr;
+
 	Result result;
 	if (options.fFrameIndex > 0)
 	{
-		std::unique_ptr<SkAPngFrameDecoder> frameCodec = SkAPngFrameDecoder::MakeFrameDecoder(stream(), &result, this, options.fFrameIndex);
+		// Frames up to this one must be in the frame table, including its required frames.
+		this->parseFrames(options.fFrameIndex);
+		if (!this->isFrameDataRetained(options.fFrameIndex)) {
+			return kCouldNotRewind;
+		}
+
+		result = this->prepareFrameCanvas(dstInfo, dst, rowBytes, options);
+		if (kSuccess != result) {
+			return result;
+		}
+
+		SkAPngFrameDecoder* frameCodec = this->getFrameDecoder(options.fFrameIndex, &result);
+		if (!frameCodec) {
+			return result;
+		}
+
+		result = frameCodec->decodeFrame(dstInfo, dst, options, rowBytes, rowsDecoded);
+		if (kSuccess == result) {
+			this->releaseDataBefore(options.fFrameIndex);
+		}
+		return result;
+	}
 
-		return frameCodec->decodeFrame(dstInfo, dst, options, rowBytes, rowsDecoded);
+	if (!this->isFrameDataRetained(0)) {
+		return kCouldNotRewind;
+	}
+	if (!this->readHeaderIfNeeded()) {
+		return kCouldNotRewind;
 	}
 
-    result = this->initializeXforms(dstInfo, options);
+    result = m_indexOutput ? this->initializeIndexXforms() : this->initializeXforms(dstInfo, options);
     if (kSuccess != result) {
         return result;
     }
@@ -769,10 +997,259 @@ SkCodec::Result SkAPngCodec::onGetPixels(const SkImageInfo& dstInfo, void* dst,
 
     this->allocateStorage(dstInfo);
     this->initializeXformParams();
-    return this->decodeAllRows(dst, rowBytes, rowsDecoded);
+    result = this->decodeAllRows(dst, rowBytes, rowsDecoded);
+    if (kSuccess == result) {
+        // Read on to frame 1's fcTL, as frame decodes do for the next frame, so that
+        // getFrameCount() reports it on a forward-only stream.
+        this->parseFrames(0);
+    }
+    return result;
 }
 
-// decode all apng frame headers
+SkCodec::Result SkAPngCodec::onStartIncrementalDecode(const SkImageInfo& dstInfo, void* dst,
+		size_t rowBytes, const SkCodec::Options& options) {
+	m_pIncrementalFrameDecoder = nullptr;
+	if (options.fFrameIndex > 0) {
+		this->parseFrames(options.fFrameIndex);
+		if (!this->isFrameDataRetained(options.fFrameIndex)) {
+			return kCouldNotRewind;
+		}
+		Result result = this->prepareFrameCanvas(dstInfo, dst, rowBytes, options);
+		if (kSuccess != result) {
+			return result;
+		}
+
+		SkAPngFrameDecoder* frameCodec = this->getFrameDecoder(options.fFrameIndex, &result);
+		if (!frameCodec) {
+			return result;
+		}
+
+		result = frameCodec->startFrameDecode(dstInfo, dst, rowBytes, options, m_sampleX, m_sampleY);
+		if (kSuccess == result) {
+			m_pIncrementalFrameDecoder = frameCodec;
+		}
+		return result;
+	}
+
+	if (!this->isFrameDataRetained(0) || !this->readHeaderIfNeeded()) {
+		return kCouldNotRewind;
+	}
+	const Result result = INHERITED::onStartIncrementalDecode(dstInfo, dst, rowBytes, options);
+	if (kSuccess == result && (1 != m_sampleX || 1 != m_sampleY)) {
+		SkSampler* sampler = INHERITED::getSampler(true);
+		sampler->setSampleX(m_sampleX);
+		sampler->setSampleY(m_sampleY);
+	}
+	return result;
+}
+
+SkCodec::Result SkAPngCodec::onIncrementalDecode(int* rowsDecoded) {
+	if (!m_pIncrementalFrameDecoder) {
+		const Result result = INHERITED::onIncrementalDecode(rowsDecoded);
+		if (kSuccess == result) {
+			this->parseFrames(0);
+		}
+		return result;
+	}
+
+	// Pick up fdAT chunks of this frame that arrived since the last call.
+	this->parseFrames(m_pIncrementalFrameDecoder->frameIndex());
+	const Result result = m_pIncrementalFrameDecoder->continueFrameDecode(rowsDecoded);
+	if (kSuccess == result) {
+		this->releaseDataBefore(m_pIncrementalFrameDecoder->frameIndex());
+		m_pIncrementalFrameDecoder = nullptr;
+	}
+	return result;
+}
+
+bool SkAPngCodec::createColorTable(const SkImageInfo& dstInfo) {
+	fColorTable = this->findSharedColorTable(dstInfo);
+	if (fColorTable) {
+		return true;
+	}
+	if (!INHERITED::createColorTable(dstInfo)) {
+		return false;
+	}
+	this->shareColorTable(dstInfo, fColorTable);
+	return true;
+}
+
+sk_sp<SkColorTable> SkAPngCodec::findSharedColorTable(const SkImageInfo& dstInfo) {
+	// The table depends on the color type, alpha type and the color xform to the
+	// destination color space; the size does not matter.
+	SkAutoMutexAcquire lock(m_colorTableMutex);
+	if (m_sharedColorTable && dstInfo.colorType() == m_sharedColorTableInfo.colorType()
+			&& dstInfo.alphaType() == m_sharedColorTableInfo.alphaType()
+			&& SkColorSpace::Equals(dstInfo.colorSpace(), m_sharedColorTableInfo.colorSpace())) {
+		return m_sharedColorTable;
+	}
+	return nullptr;
+}
+
+void SkAPngCodec::shareColorTable(const SkImageInfo& dstInfo, sk_sp<SkColorTable> colorTable) {
+	SkAutoMutexAcquire lock(m_colorTableMutex);
+	m_sharedColorTable = std::move(colorTable);
+	m_sharedColorTableInfo = dstInfo;
+}
+
+SkSampler* SkAPngCodec::getSampler(bool createIfNecessary) {
+	// The main swizzler only decodes frame 0. Frame decoders are sampled through
+	// getSampledPixels, which sets them up before any row is decoded.
+	if (m_pIncrementalFrameDecoder) {
+		return nullptr;
+	}
+	return INHERITED::getSampler(createIfNecessary);
+}
+
+SkCodec::Result SkAPngCodec::getSampledPixels(const SkImageInfo& info, void* pixels, size_t rowBytes,
+		const Options& options, int sampleSize) {
+	const SkIRect bounds = SkIRect::MakeWH(this->getInfo().width(), this->getInfo().height());
+	SkIRect subset = options.fSubset ? *options.fSubset : bounds;
+	if (sampleSize < 1 || subset.isEmpty() || !bounds.contains(subset)
+			|| info.width() != get_scaled_dimension(subset.width(), sampleSize)
+			|| info.height() != get_scaled_dimension(subset.height(), sampleSize)) {
+		return kInvalidParameters;
+	}
+
+	// As in SkSampledCodec, a sample size larger than the subset keeps its middle pixel.
+	m_sampleX = subset.width() / info.width();
+	m_sampleY = subset.height() / info.height();
+
+	// Rows and columns come from options.fSubset of the full-size image; pixels hold them
+	// sampled.
+	Options sampledOptions = options;
+	sampledOptions.fSubset = &subset;
+	int rowsDecoded = 0;
+	Result result = this->startIncrementalDecode(info.makeWH(bounds.width(), bounds.height()),
+		pixels, rowBytes, &sampledOptions);
+	if (kSuccess == result) {
+		result = this->incrementalDecode(&rowsDecoded);
+	}
+	m_sampleX = 1;
+	m_sampleY = 1;
+
+	// Rows of later frames that never arrived keep the frame they are drawn over.
+	if (kIncompleteInput == result && 0 == options.fFrameIndex) {
+		this->fillIncompleteImage(info, pixels, rowBytes, options.fZeroInitialized,
+			info.height(), rowsDecoded);
+	}
+	return result;
+}
+
+int SkAPngCodec::getPalette(SkPMColor colors[256], int* transparentIndex)
+{
+	if (transparentIndex) {
+		*transparentIndex = -1;
+	}
+	sk_bzero(colors, 256 * sizeof(SkPMColor));
+	if (SkEncodedInfo::kPalette_Color != this->getEncodedInfo().color()) {
+		return 0;
+	}
+
+	// The compact header (signature, IHDR, PLTE, tRNS) always outlives the png_structs,
+	// which onRewind() destroys.
+	const png_byte* data = (const png_byte*)m_pAPngReader->getAPngHeadData();
+	const size_t length = m_pAPngReader->getAPngHeadDataLen();
+	const png_byte* palette = nullptr;
+	const png_byte* alpha = nullptr;
+	int count = 0;
+	int alphaCount = 0;
+	for (size_t offset = 8; offset + 12 <= length; ) {
+		const png_byte* chunk = data + offset;
+		const size_t chunkLength = png_get_uint_32(chunk);
+		if (chunkLength > length - offset - 12) {
+			break;
+		}
+		if (is_chunk(chunk, "PLTE")) {
+			palette = chunk + 8;
+			count = SkTMin<int>(chunkLength / 3, 256);
+		} else if (is_chunk(chunk, "tRNS")) {
+			alpha = chunk + 8;
+			alphaCount = SkTMin<int>(chunkLength, 256);
+		}
+		offset += chunkLength + 12;
+	}
+
+	m_transparentIndex = -1;
+	m_paletteHasPartialAlpha = false;
+	memset(m_paletteAlpha, 0, sizeof(m_paletteAlpha));
+	for (int i = 0; i < count; i++) {
+		const U8CPU a = i < alphaCount ? alpha[i] : 0xFF;
+		colors[i] = SkPreMultiplyARGB(a, palette[3 * i], palette[3 * i + 1], palette[3 * i + 2]);
+		m_paletteAlpha[i] = a;
+		if (0 == a && m_transparentIndex < 0) {
+			m_transparentIndex = i;
+		}
+		m_paletteHasPartialAlpha |= (0 != a && 0xFF != a);
+	}
+	if (transparentIndex) {
+		*transparentIndex = m_transparentIndex;
+	}
+	return count;
+}
+
+SkCodec::Result SkAPngCodec::getFrameIndices(const Options& options, uint8_t* indices, size_t rowBytes)
+{
+	const SkImageInfo indexInfo = SkImageInfo::MakeA8(this->getInfo().width(), this->getInfo().height());
+	if (SkEncodedInfo::kPalette_Color != this->getEncodedInfo().color()) {
+		return kInvalidConversion;
+	}
+	if (!indices || rowBytes < indexInfo.minRowBytes() || options.fSubset
+			|| options.fFrameIndex < 0 || options.fFrameIndex >= this->getFrameCount()) {
+		return kInvalidParameters;
+	}
+
+	SkPMColor colors[256];
+	if (!this->getPalette(colors, nullptr)) {
+		return kInvalidInput;
+	}
+
+	// The index decode sets the main png_struct and frame decoders up differently (the
+	// A8 info makes frame decoders redo theirs), so it starts and ends like a rewind.
+	Options indexOptions = options;
+	indexOptions.fZeroInitialized = kNo_ZeroInitialized;
+	m_pIncrementalFrameDecoder = nullptr;
+	this->onRewind();
+	m_indexOutput = true;
+	int rowsDecoded = indexInfo.height();
+	const Result result = this->onGetPixels(indexInfo, indices, rowBytes, indexOptions, &rowsDecoded);
+	m_indexOutput = false;
+	this->onRewind();
+
+	if (kIncompleteInput == result && 0 == options.fFrameIndex) {
+		zero_rect(indexInfo, indices, rowBytes,
+			SkIRect::MakeLTRB(0, rowsDecoded, indexInfo.width(), indexInfo.height()), this->clearIndex());
+	}
+	return result;
+}
+
+// Looks for an acTL before the first IDAT by reading chunk headers only. Static PNGs are
+// rejected here without a png_struct, CRC checks or reading any chunk data.
+static bool has_actl_before_idat(SkStream* stream)
+{
+	png_byte buffer[8];
+	// Skip the signature, which MakeFromStream has already checked.
+	if (stream->skip(8) < 8) {
+		return false;
+	}
+
+	while (stream->read(buffer, 8) == 8) {
+		if (is_chunk(buffer, "acTL")) {
+			return true;
+		}
+		if (is_chunk(buffer, "IDAT")) {
+			return false;
+		}
+		// Skip the chunk data + CRC.
+		const size_t length = png_get_uint_32(buffer) + 4;
+		if (stream->skip(length) < length) {
+			return false;
+		}
+	}
+	return false;
+}
+
+// decode the apng header, up to the first IDAT. Later frames are found by SkAPngReader::parseFrames.
 bool AutoCleanAPngFrames::decodeFrameInfos(SkStream* stream, SkAPngReader * apngReader)
 {
 	if (apngReader && apngReader->needParseFrameInfo())
@@ -815,12 +1292,15 @@ bool AutoCleanAPngFrames::decodeFrameInfos(SkStream* stream, SkAPngReader * apng
 			// Parse chunk length and type.
 			if (stream->read(buffer, 8) < 8) {
 				// We have read to the end of the input without decoding bounds.
-				apngReader->setNeedParseFrameInfo(false);
-				break;
+				return false;
 			}
 
 			png_byte* chunk = reinterpret_cast<png_byte*>(buffer);
 			const size_t length = png_get_uint_32(chunk);
+			// APNG chunks are skipped past without libpng, which would reject this.
+			if (length > PNG_UINT_31_MAX) {
+				return false;
+			}
 
 			if (is_chunk(chunk, "IHDR"))
 			{
@@ -898,31 +1378,35 @@ bool AutoCleanAPngFrames::decodeFrameInfos(SkStream* stream, SkAPngReader * apng
 					// save this info to SkAPngReader
 					const int numberPasses = png_set_interlace_handling(png_ptr);
 					apngReader->setNumberPasses(numberPasses);				
+
+					// every chunk that affects alpha precedes IDAT.
+					png_byte colorType = png_get_color_type(png_ptr, info_ptr);
+					apngReader->setHasAlpha((colorType & PNG_COLOR_MASK_ALPHA)
+						|| png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS));
+
+					// The rest of the frame table is filled on demand by SkAPngReader::parseFrames,
+					// starting with the chunk after this IDAT.
+					apngReader->setNextChunkPosition(posAPngHeaderEnd + length + 4);
 				}
 				hasParsedHeader = true;
+				apngReader->setNeedParseFrameInfo(false);
+				break;
 			}
 
-			if (is_chunk(chunk, "acTL")) {
-				if (length == 8)
-				{
-					if (!apngReader->parseFrameInfos(stream, 8, "acTL"))
-						return false;
+			if (is_apng_tag(chunk + 4)) {
+				// Only the first bytes of the chunk data are needed; the rest is skipped.
+				const size_t dataPosition = stream->getPosition();
+				const size_t infoBytes = std::min(length, SkAPngReader::kMaxFrameInfoBytes);
+				png_byte* info = chunk + 8;
+				if (stream->read(info, infoBytes) < infoBytes)
+					return false;
+				if (!apngReader->parseFrameInfos(info, dataPosition, (int)length, (const char*)chunk + 4))
+					return false;
+				if (is_chunk(chunk, "acTL") && length == 8)
 					hasParsedFrameHeader = true;
-				}
-			}
-			if (is_chunk(chunk, "fcTL")) {
-				if (length == 26)
-				{
-					if (!apngReader->parseFrameInfos(stream, 26, "fcTL"))
-						return false;
-				}
-			}
-			if (is_chunk(chunk, "fdAT")) {
-				if (length >= 4)
-				{
-					if (!apngReader->parseFrameInfos(stream, length, "fdAT"))
-						return false;
-				}
+				if (stream->skip(length - infoBytes + 4) < length - infoBytes + 4)
+					return false;
+				continue;
 			}
 
 			png_process_data(png_ptr, info_ptr, chunk, 8);
@@ -932,7 +1416,7 @@ bool AutoCleanAPngFrames::decodeFrameInfos(SkStream* stream, SkAPngReader * apng
 			}
 		}
 
-		if (apngReader->frameCount() <= 1)
+		if (!hasParsedHeader || apngReader->frameCount() <= 1)
 		{
 			return false;
 		}
@@ -941,8 +1425,15 @@ bool AutoCleanAPngFrames::decodeFrameInfos(SkStream* stream, SkAPngReader * apng
 }
 
 //for apng
-SkCodec::Result SkAPngCodec::parseAPngInfos(SkCodec** outCodec, SkStream* stream, SkPngChunkReader* chunkReader)
+SkCodec::Result SkAPngCodec::parseAPngInfos(SkCodec** outCodec, SkStream* stream, SkPngChunkReader* chunkReader,
+	SkAPngStreamBuffer* streamBuffer)
 {
+	const bool isAnimated = has_actl_before_idat(stream);
+	if (!stream->rewind() || !isAnimated)
+	{
+		return kUnimplemented;
+	}
+
 	SkAPngReader * pAPngReader = new SkAPngReader();
 	bool parseSuccess = AutoCleanAPngFrames::decodeFrameInfos(stream, pAPngReader);
 	if (!parseSuccess)
@@ -954,6 +1445,7 @@ SkCodec::Result SkAPngCodec::parseAPngInfos(SkCodec** outCodec, SkStream* stream
 	if (kSuccess == result) {
 		// Codec has taken ownership of the stream.
 		SkASSERT(outCodec);
+		static_cast<SkAPngCodec*>(*outCodec)->m_pStreamBuffer = streamBuffer;
 	}
 	else
 	{
@@ -964,9 +1456,40 @@ SkCodec::Result SkAPngCodec::parseAPngInfos(SkCodec** outCodec, SkStream* stream
 }
 
 
+void SkAPngCodec::parseFrames(int untilFrame)
+{
+	if (m_pAPngReader)
+		m_pAPngReader->parseFrames(this->stream(), untilFrame);
+}
+
+void SkAPngCodec::parseBufferedFrames(int untilFrame)
+{
+	if (m_pAPngReader)
+		m_pAPngReader->parseFrames(this->stream(), untilFrame,
+			m_pStreamBuffer ? m_pStreamBuffer->bufferedEnd() : 0);
+}
+
+sk_sp<SkData> SkAPngCodec::serializeFrameIndex(uint64_t contentHash)
+{
+	if (!m_pAPngReader || !this->stream()->hasLength())
+		return nullptr;
+	this->parseFrames(-1);
+	return m_pAPngReader->serializeFrameTable(this->stream()->getLength(), contentHash);
+}
+
+bool SkAPngCodec::loadFrameIndex(const void* data, size_t length, uint64_t contentHash)
+{
+	if (!m_pAPngReader || !this->stream()->hasLength())
+		return false;
+	return m_pAPngReader->loadFrameTable(data, length, this->stream(), contentHash);
+}
+
 int SkAPngCodec::onGetFrameCount()
 {
-	return m_pAPngReader->frameCount();
+	// Like SkGifCodec, report the frames found in the data available so far. Only chunk
+	// headers are read to find them, and a forward-only stream is not read any further.
+	this->parseBufferedFrames(-1);
+	return std::max(1, std::min(m_pAPngReader->knownFrameCount(), m_pAPngReader->frameCount()));
 }
 bool SkAPngCodec::onGetFrameInfo(int i, FrameInfo* frameInfo) const
 {
@@ -977,6 +1500,9 @@ bool SkAPngCodec::onGetFrameInfo(int i, FrameInfo* frameInfo) const
 		return false;
 	}
 
+	// Scan only as far as frame i, in the data available so far.
+	const_cast<SkAPngCodec*>(this)->parseBufferedFrames(i);
+
 	const SkAPngFrameContext* frameContext = m_pAPngReader->frameContext(i);
 	if (!frameContext)
 		return false;
@@ -1010,7 +1536,186 @@ const SkFrameHolder* SkAPngCodec::getFrameHolder() const
 	return m_pAPngReader;
 }
 
-SkStream *SkAPngCodec::makeFrameStream(int frameIndex)
+SkIRect SkAPngCodec::getFrameDirtyRect(int frameIndex, int priorFrame)
+{
+	const SkIRect canvas = SkIRect::MakeWH(this->getInfo().width(), this->getInfo().height());
+	this->parseFrames(frameIndex);
+	const SkFrame* frame = m_pAPngReader->getFrame(frameIndex);
+	if (!frame || kNone == priorFrame || kNone == frame->getRequiredFrame()) {
+		return canvas;
+	}
+
+	SkIRect dirty = frame->frameRect();
+	const SkFrame* prior = m_pAPngReader->getFrame(priorFrame);
+	if (prior && SkCodecAnimation::DisposalMethod::kRestoreBGColor == prior->getDisposalMethod()) {
+		dirty.join(prior->frameRect());
+	}
+	if (!dirty.intersect(canvas)) {
+		return SkIRect::MakeEmpty();
+	}
+	return dirty;
+}
+
+std::unique_ptr<SkStream> SkAPngCodec::makeFrameStream()
+{
+	SkStream* stream = this->stream();
+	if (const void* memoryBase = stream->getMemoryBase()) {
+		if (stream->hasLength()) {
+			return std::unique_ptr<SkStream>(new SkMemoryStream(memoryBase, stream->getLength(), false));
+		}
+	}
+	return std::unique_ptr<SkStream>(stream->duplicate());
+}
+
+SkCodec::Result SkAPngCodec::getFramesPixels(const SkImageInfo& info, void* const frames[], size_t rowBytes,
+		int firstFrame, int lastFrame, SkExecutor* executor)
 {
-	return this->stream();
+	if (!frames || firstFrame < 0 || firstFrame > lastFrame || info.dimensions() != this->getInfo().dimensions()
+			|| rowBytes < info.minRowBytes()) {
+		return kInvalidParameters;
+	}
+
+	// Tasks only read the frame table, so it is completed up front.
+	this->parseFrames(lastFrame);
+	if (lastFrame >= std::min(m_pAPngReader->knownFrameCount(), m_pAPngReader->frameCount())) {
+		return kInvalidParameters;
+	}
+
+	// Frames before firstFrame are decoded too if the range depends on them.
+	int begin = firstFrame;
+	for (int i = lastFrame; i >= begin; i--) {
+		const int required = m_pAPngReader->getFrame(i)->getRequiredFrame();
+		if (kNone != required && required < begin) {
+			begin = required;
+		}
+	}
+
+	// Only frames of the range and the frames they are drawn over are decoded. A run
+	// starts at a frame that needs no earlier frame and that no later frame reaches past.
+	const int count = lastFrame - begin + 1;
+	std::vector<bool> needed(count, false);
+	std::vector<int> runStarts;
+	int minRequired = lastFrame + 1;
+	for (int i = lastFrame; i >= begin; i--) {
+		const int required = m_pAPngReader->getFrame(i)->getRequiredFrame();
+		if (i >= firstFrame) {
+			needed[i - begin] = true;
+		}
+		if (kNone == required) {
+			if (minRequired >= i) {
+				runStarts.push_back(i);
+			}
+		} else {
+			if (needed[i - begin]) {
+				needed[required - begin] = true;
+			}
+			minRequired = std::min(minRequired, required);
+		}
+	}
+	std::reverse(runStarts.begin(), runStarts.end());
+	SkASSERT(!runStarts.empty() && begin == runStarts.front());
+
+	// Frames of a loaded frame index are checked here, as runs only read the frame table.
+	for (int i = std::max(begin, 1); i <= lastFrame; i++) {
+		if (needed[i - begin] && !m_pAPngReader->verifyFrame(this->stream(), i)) {
+			return kInvalidInput;
+		}
+	}
+
+	// Needed frames before the range go to scratch canvases.
+	const size_t canvasSize = rowBytes * info.height();
+	int scratchCount = 0;
+	for (int i = begin; i < firstFrame; i++) {
+		scratchCount += needed[i - begin] ? 1 : 0;
+	}
+	SkAutoTMalloc<uint8_t> scratch(scratchCount * canvasSize);
+	std::vector<void*> canvases(count, nullptr);
+	for (int i = begin, s = 0; i <= lastFrame; i++) {
+		if (i >= firstFrame) {
+			canvases[i - begin] = frames[i - firstFrame];
+		} else if (needed[i - begin]) {
+			canvases[i - begin] = scratch.get() + canvasSize * s++;
+		}
+	}
+
+	// Each run reads frame data through its own stream. Frame 0 is decoded by this codec,
+	// which only the run starting at frame 0 uses.
+	const int runCount = static_cast<int>(runStarts.size());
+	std::vector<std::unique_ptr<SkStream>> streams(runCount);
+	bool parallel = runCount > 1;
+	for (int run = 0; run < runCount && parallel; run++) {
+		streams[run] = this->makeFrameStream();
+		parallel = streams[run] != nullptr;
+	}
+
+	std::vector<Result> results(runCount, kSuccess);
+	auto decodeRun = [&](int run) {
+		const int end = run + 1 < runCount ? runStarts[run + 1] : lastFrame + 1;
+		SkStream* stream = parallel ? streams[run].get() : this->stream();
+		// Runs on other threads cannot share the codec's scratch memory.
+		SkAPngScratchArena runArena;
+		SkAPngScratchArena* arena = parallel ? &runArena : &m_scratchArena;
+		std::unique_ptr<SkAPngFrameDecoder> decoder;
+		Result result = kSuccess;
+		for (int i = runStarts[run]; i < end && kSuccess == result; i++) {
+			void* dst = canvases[i - begin];
+			if (!dst) {
+				continue;
+			}
+			if (0 == i) {
+				Options options;
+				result = this->getPixels(info, dst, rowBytes, &options);
+				continue;
+			}
+
+			const SkFrame* frame = m_pAPngReader->getFrame(i);
+			const int required = frame->getRequiredFrame();
+			if (kNone == required) {
+				zero_rect(info, dst, rowBytes, SkIRect::MakeWH(info.width(), info.height()));
+			} else {
+				const void* src = canvases[required - begin];
+				for (int y = 0; y < info.height(); y++) {
+					memcpy(SkTAddOffset<void>(dst, y * rowBytes), SkTAddOffset<const void>(src, y * rowBytes),
+						info.minRowBytes());
+				}
+				const SkFrame* requiredFrame = m_pAPngReader->getFrame(required);
+				if (SkCodecAnimation::DisposalMethod::kRestoreBGColor == requiredFrame->getDisposalMethod()) {
+					zero_rect(info, dst, rowBytes, requiredFrame->frameRect());
+				}
+			}
+
+			if (decoder) {
+				result = decoder->resetFrame(i);
+			} else {
+				decoder = SkAPngFrameDecoder::MakeFrameDecoder(stream, arena, &result, this, i);
+			}
+			if (!decoder || kSuccess != result) {
+				break;
+			}
+
+			Options options;
+			options.fFrameIndex = i;
+			options.fPriorFrame = required;
+			int rowsDecoded;
+			result = decoder->decodeFrame(info, dst, options, rowBytes, &rowsDecoded);
+		}
+		results[run] = result;
+	};
+
+	if (parallel) {
+		SkTaskGroup taskGroup(executor ? *executor : SkExecutor::GetDefault());
+		taskGroup.batch(runCount, decodeRun);
+		taskGroup.wait();
+	} else {
+		for (int run = 0; run < runCount; run++) {
+			decodeRun(run);
+		}
+	}
+
+	for (Result result : results) {
+		if (kSuccess != result) {
+			return result;
+		}
+	}
+	return kSuccess;
 }
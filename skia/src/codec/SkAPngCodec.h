@@ -7,14 +7,31 @@
 #ifndef SkAPngCodec_DEFINED
 #define SkAPngCodec_DEFINED
 
+#include "SkAPngScratchArena.h"
+#include "SkMutex.h"
 #include "SkPngCodec.h"
 
+#include <memory>
+#include <vector>
+
 class SkAPngReader;
+class SkAPngFrameDecoder;
+class SkAPngStreamBuffer;
+class SkData;
+class SkExecutor;
 class SkAPngCodec : public SkPngCodec {
 public:
     ~SkAPngCodec() override;
 
-	static Result parseAPngInfos(SkCodec** outCodec, SkStream* stream, SkPngChunkReader* chunkReader);
+	// streamBuffer is stream if it buffers a forward-only stream, else nullptr. Frames of such
+	// a stream are decoded once, in order: data before the last frame decoded is dropped, and
+	// decoding an earlier frame (or a later one without options.fPriorFrame, once its
+	// required frame is gone) returns kCouldNotRewind. As SkGifCodec does with partial data,
+	// getFrameCount() and getFrameInfo() only report the frames found in the data buffered
+	// so far. Decoding a frame reads on to the next frame's fcTL, so the table grows one
+	// frame ahead of decoding.
+	static Result parseAPngInfos(SkCodec** outCodec, SkStream* stream, SkPngChunkReader* chunkReader,
+		SkAPngStreamBuffer* streamBuffer);
 
 	int getBitDepth()
 	{
@@ -25,14 +42,107 @@ public:
 		return m_pAPngReader;
 	}
 
-	SkStream *makeFrameStream(int frameIndex);
+	// The part of the canvas that decoding frameIndex over priorFrame changes: the frame
+	// rect, and what priorFrame's disposal clears. The whole canvas for kNone, since the
+	// frame is then decoded from scratch.
+	SkIRect getFrameDirtyRect(int frameIndex, int priorFrame);
+
+	// A stream frame decoders on other threads can read frame data from: a view of the same
+	// memory for memory-backed streams, which frame decoders never move, else a duplicate
+	// with its own position. nullptr if the stream cannot be duplicated.
+	std::unique_ptr<SkStream> makeFrameStream();
+
+	// Decodes frames [firstFrame, lastFrame] into frames[i - firstFrame], each a canvas of
+	// info. The frames are split into runs that only depend on frames of their own run,
+	// and runs are decoded in parallel on executor (SkExecutor::GetDefault() if nullptr);
+	// frames within a run are decoded in order, each from a copy of its required frame.
+	Result getFramesPixels(const SkImageInfo& info, void* const frames[], size_t rowBytes,
+		int firstFrame, int lastFrame, SkExecutor* executor = nullptr);
+
+	// Decodes options.fFrameIndex limited to options.fSubset (if set), keeping every
+	// sampleSize-th row and column as SkSampledCodec does. info must have the sampled size
+	// of the subset. Frames are composited at that scale and inflating stops after the
+	// last row that is kept.
+	Result getSampledPixels(const SkImageInfo& info, void* pixels, size_t rowBytes,
+		const Options& options, int sampleSize);
+
+	// Frame index sidecar: the whole frame table as a blob for an on-disk cache, scanning
+	// all frame chunks first. contentHash is the caller's hash of the whole file (the key
+	// the blob is cached under will do), kept in the blob. nullptr if the data is
+	// incomplete or has no known length.
+	sk_sp<SkData> serializeFrameIndex(uint64_t contentHash);
+
+	// On a warm open, installs a serializeFrameIndex() blob of the same file so that no
+	// frame chunk is scanned again. Only frame 0's fcTL and the first fdAT chunk and its
+	// fcTL are read back to check it; every other frame's fcTL is read back when that frame
+	// is first decoded, which fails with kInvalidInput if it does not match. Returns false,
+	// and frames are scanned as usual, if the blob does not match contentHash or this
+	// file's length and header.
+	bool loadFrameIndex(const void* data, size_t length, uint64_t contentHash);
+
+	// Palette images: writes the palette as premultiplied N32 colors, exactly as encoded
+	// (no color space conversion), and returns how many entries it has, or 0 if the image
+	// has no palette. Entries after those are transparent black. transparentIndex, if not
+	// nullptr, gets the first fully transparent entry, or -1.
+	int getPalette(SkPMColor colors[256], int* transparentIndex);
+
+	// Palette images: composites frame options.fFrameIndex as palette indices, one byte
+	// per pixel, into a canvas-sized indices, so that a caller keeping getPalette() can skip
+	// expanding pixels it does not draw. Cleared areas get the transparent index. Returns
+	// kUnimplemented if an area must be cleared and the palette has no transparent entry,
+	// or a frame is blended over another with partially transparent entries, which has no
+	// index result. options.fSubset is not supported.
+	Result getFrameIndices(const Options& options, uint8_t* indices, size_t rowBytes);
+
+	// State of getFrameIndices() for frame decoders: whether indices are being decoded, the
+	// alpha of each palette entry, and the index that clears a pixel.
+	bool isIndexOutput() const { return m_indexOutput; }
+	const uint8_t* paletteAlpha() const { return m_paletteAlpha; }
+	uint8_t clearIndex() const { return m_transparentIndex >= 0 ? (uint8_t)m_transparentIndex : 0; }
+	bool paletteHasPartialAlpha() const { return m_paletteHasPartialAlpha; }
+
+	// The color table built for dstInfo by this codec or one of its frame decoders, if any.
+	// Every frame has the same palette, so it only needs building once per destination.
+	sk_sp<SkColorTable> findSharedColorTable(const SkImageInfo& dstInfo);
+	void shareColorTable(const SkImageInfo& dstInfo, sk_sp<SkColorTable> colorTable);
+
+	// Heap allocations made for frame decoding so far, setting up the frame decoder included.
+	// Once every frame has been decoded, replaying the animation adds none. Frame 0 is
+	// decoded by this codec itself and is not counted.
+	int frameHeapAllocations() const { return m_scratchArena.heapAllocations(); }
 
 protected:
     SkAPngCodec(const SkEncodedInfo&, const SkImageInfo&, std::unique_ptr<SkStream>,
                SkPngChunkReader*, void* png_ptr, void* info_ptr, int bitDepth, SkAPngReader *pAPngReader);
 
-	bool onRewind();
+	bool onRewind() override;
     Result onGetPixels(const SkImageInfo&, void*, size_t, const Options&, int*) override;
+	Result onStartIncrementalDecode(const SkImageInfo& dstInfo, void* pixels, size_t rowBytes,
+		const SkCodec::Options&) override;
+	Result onIncrementalDecode(int*) override;
+	SkSampler* getSampler(bool createIfNecessary) override;
+	bool createColorTable(const SkImageInfo& dstInfo) override;
+
+	// Extends the frame table up to untilFrame (-1: all available data).
+	void parseFrames(int untilFrame);
+	// As above, but a forward-only stream is only scanned as far as it is buffered.
+	void parseBufferedFrames(int untilFrame);
+
+	// Re-reads the main png header, deferred from onRewind() until frame 0 is decoded.
+	bool readHeaderIfNeeded();
+
+	// Puts the frame that options.fFrameIndex is drawn over into dst, disposed, touching
+	// only what changes: a prior frame supplied by the caller is reused as is.
+	Result prepareFrameCanvas(const SkImageInfo& dstInfo, void* dst, size_t rowBytes,
+		const Options& options);
+
+	// For forward-only streams: whether the data of frameIndex is still buffered, and
+	// dropping the data before frameIndex once it has been decoded.
+	bool isFrameDataRetained(int frameIndex);
+	void releaseDataBefore(int frameIndex);
+
+	// Returns a frame decoder ready for frameIndex, reusing the one kept for earlier frames.
+	SkAPngFrameDecoder* getFrameDecoder(int frameIndex, Result* result);
 
 	int onGetFrameCount() override;
 	bool onGetFrameInfo(int, FrameInfo*) const override;
@@ -40,6 +150,30 @@ protected:
 	const SkFrameHolder* getFrameHolder() const override;
 
 	SkAPngReader* m_pAPngReader;
+	// The codec's stream when it buffers a forward-only stream, else nullptr.
+	SkAPngStreamBuffer* m_pStreamBuffer;
+
+	// Scratch memory of the frame decoder, reused across frames and loops.
+	SkAPngScratchArena m_scratchArena;
+	// Frame decoder kept alive between frames; resetFrame points it at frames of any size.
+	std::unique_ptr<SkAPngFrameDecoder> m_frameDecoder;
+	bool m_bNeedReadHeader;
+	// frame decoder of an incremental decode of a frame after the first, or nullptr.
+	SkAPngFrameDecoder* m_pIncrementalFrameDecoder;
+	// Sampling of the decode in progress, set by getSampledPixels.
+	int m_sampleX;
+	int m_sampleY;
+
+	// Set while getFrameIndices decodes; the palette is read by getPalette.
+	bool m_indexOutput;
+	int m_transparentIndex;
+	bool m_paletteHasPartialAlpha;
+	uint8_t m_paletteAlpha[256];
+
+	// Frame decoders on other threads (getFramesPixels) share the color table too.
+	SkMutex m_colorTableMutex;
+	sk_sp<SkColorTable> m_sharedColorTable;
+	SkImageInfo m_sharedColorTableInfo;
 
 private:
 
@@ -8,6 +8,11 @@
 #include "SkAPngFrameDecoder.h"
 #include "SkAPngReader.h"
 #include "SkAPngCodec.h"
+#include "SkAPngScratchArena.h"
+#include "SkBlitRow.h"
+#include "SkCodecPriv.h"
+#include "SkHalf.h"
+#include "SkNx.h"
 
 #include <algorithm>
 
@@ -27,8 +32,8 @@ constexpr int kStopDecoding = 2;
 
 class SkAPngNormalFrameDecoder final : public SkAPngFrameDecoder {
 public:
-	SkAPngNormalFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pngStream, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex)
-		: INHERITED(encodedInfo, imageInfo, pngStream, png_ptr, info_ptr, bitDepth, pMainCodec, frameIndex)
+	SkAPngNormalFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pngStream, SkAPngScratchArena* arena, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex)
+		: INHERITED(encodedInfo, imageInfo, pngStream, arena, png_ptr, info_ptr, bitDepth, pMainCodec, frameIndex)
 		, fRowsWrittenToOutput(0)
 		, fDst(nullptr)
 		, fRowBytes(0)
@@ -61,7 +66,7 @@ private:
 	}
 
 	Result decodeAllRows(void* dst, size_t rowBytes, int* rowsDecoded) override {
-		const int height = this->getInfo().height();
+		const int height = m_frameHeight;
 		png_set_progressive_read_fn(this->png_ptr(), this, nullptr, AllRowsCallback, nullptr);
 		fDst = dst;
 		fRowBytes = rowBytes;
@@ -71,12 +76,7 @@ private:
 		fLastRow = height - 1;
 
 
-		const std::vector<SkAPngFrameBlock>* blocks = m_pMainCodec->getAPngReader()->frameContext(m_frameIndex)->getIDATBlocks();
-		for (std::vector<SkAPngFrameBlock>::const_iterator it = blocks->begin();
-			it != blocks->end(); it++)
-		{
-			processfdATData(it->blockPosition, it->blockSize);
-		}
+		this->processFrameData();
 
 		if (fRowsWrittenToOutput == height) {
 			return SkCodec::kSuccess;
@@ -97,9 +97,27 @@ private:
 	}
 
 	void setRange(int firstRow, int lastRow, void* dst, size_t rowBytes) override {
+		png_set_progressive_read_fn(this->png_ptr(), this, nullptr, RowCallback, nullptr);
+		fFirstRow = firstRow;
+		fLastRow = lastRow;
+		fDst = dst;
+		fRowBytes = rowBytes;
+		fRowsWrittenToOutput = 0;
+		fRowsNeeded = this->frameRowsNeeded();
 	}
 
 	SkCodec::Result decode(int* rowsDecoded) override {
+		// Resumes after the last fdAT byte fed, so each call only processes new data.
+		this->processFrameData();
+
+		if (fRowsWrittenToOutput == fRowsNeeded) {
+			return SkCodec::kSuccess;
+		}
+
+		if (rowsDecoded) {
+			*rowsDecoded = fRowsWrittenToOutput;
+		}
+
 		return SkCodec::kIncompleteInput;
 	}
 
@@ -112,10 +130,7 @@ private:
 		SkASSERT(rowNum <= fLastRow);
 		SkASSERT(fRowsWrittenToOutput < fRowsNeeded);
 
-		// If there is no swizzler, all rows are needed.
-		if (!this->swizzler() || this->swizzler()->rowNeeded(rowNum - fFirstRow)) {
-			this->applyXformRow(fDst, row);
-			fDst = SkTAddOffset<void>(fDst, fRowBytes);
+		if (this->writeFrameRow(fDst, fRowBytes, rowNum, row)) {
 			fRowsWrittenToOutput++;
 		}
 
@@ -128,14 +143,15 @@ private:
 
 class SkAPngInterlacedFrameDecoder final : public SkAPngFrameDecoder {
 public:
-	SkAPngInterlacedFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pngStream, void* png_ptr, void* info_ptr, int bitDepth, int numberPasses, SkAPngCodec* pMainCodec, int frameIndex)
-		: INHERITED(encodedInfo, imageInfo, pngStream, png_ptr, info_ptr, bitDepth, pMainCodec, frameIndex)
+	SkAPngInterlacedFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pngStream, SkAPngScratchArena* arena, void* png_ptr, void* info_ptr, int bitDepth, int numberPasses, SkAPngCodec* pMainCodec, int frameIndex)
+		: INHERITED(encodedInfo, imageInfo, pngStream, arena, png_ptr, info_ptr, bitDepth, pMainCodec, frameIndex)
 		, fNumberPasses(numberPasses)
 		, fFirstRow(0)
 		, fLastRow(0)
 		, fLinesDecoded(0)
 		, fInterlacedComplete(false)
 		, fPng_rowbytes(0)
+		, fInterlaceBuffer(nullptr)
 	{}
 
 	static void InterlacedRowCallback(png_structp png_ptr, png_bytep row, png_uint_32 rowNum, int pass) {
@@ -152,7 +168,8 @@ private:
 	int                     fLinesDecoded;
 	bool                    fInterlacedComplete;
 	size_t                  fPng_rowbytes;
-	SkAutoTMalloc<png_byte> fInterlaceBuffer;
+	// Borrowed from the scratch arena for the current frame.
+	png_bytep               fInterlaceBuffer;
 
 	typedef SkAPngFrameDecoder INHERITED;
 
@@ -165,7 +182,7 @@ private:
 			return;
 		}
 
-		png_bytep oldRow = fInterlaceBuffer.get() + (rowNum - fFirstRow) * fPng_rowbytes;
+		png_bytep oldRow = fInterlaceBuffer + (rowNum - fFirstRow) * fPng_rowbytes;
 		png_progressive_combine_row(this->png_ptr(), oldRow, row);
 
 		if (0 == pass) {
@@ -179,20 +196,15 @@ private:
 			if (fNumberPasses - 1 == pass && rowNum == fLastRow) {
 				// Last pass, and we have read all of the rows we care about.
 				fInterlacedComplete = true;
-				if (fLastRow != this->getInfo().height() - 1 ||
-					(this->swizzler() && this->swizzler()->sampleY() != 1)) {
-					// Fake error to stop decoding scanlines. Only stop if we're not decoding the
-					// whole image, in which case processing the rest of the image might be
-					// expensive. When decoding the whole image, read through the IEND chunk to
-					// preserve Android behavior of leaving the input stream in the right place.
-					longjmp(PNG_JMPBUF(this->png_ptr()), kStopDecoding);
-				}
+				// Fake error to stop decoding scanlines. Only this frame's fdAT data is fed,
+				// so there is no stream position to preserve.
+				longjmp(PNG_JMPBUF(this->png_ptr()), kStopDecoding);
 			}
 		}
 	}
 
 	SkCodec::Result decodeAllRows(void* dst, size_t rowBytes, int* rowsDecoded) override {
-		const int height = this->getInfo().height();
+		const int height = m_frameHeight;
 		this->setUpInterlaceBuffer(height);
 		png_set_progressive_read_fn(this->png_ptr(), this, nullptr, InterlacedRowCallback,
 			nullptr);
@@ -201,9 +213,9 @@ private:
 		fLastRow = height - 1;
 		fLinesDecoded = 0;
 
-		this->processData();
+		this->processFrameData();
 
-		png_bytep srcRow = fInterlaceBuffer.get();
+		png_bytep srcRow = fInterlaceBuffer;
 		// FIXME: When resuming, this may rewrite rows that did not change.
 		for (int rowNum = 0; rowNum < fLinesDecoded; rowNum++) {
 			this->applyXformRow(dst, srcRow);
@@ -222,15 +234,57 @@ private:
 	}
 
 	void setRange(int firstRow, int lastRow, void* dst, size_t rowBytes) override {
+		// FIXME: We could skip rows in the interlace buffer that we won't put in the output.
+		this->setUpInterlaceBuffer(lastRow - firstRow + 1);
+		png_set_progressive_read_fn(this->png_ptr(), this, nullptr, InterlacedRowCallback, nullptr);
+		fFirstRow = firstRow;
+		fLastRow = lastRow;
+		fDst = dst;
+		fRowBytes = rowBytes;
+		fLinesDecoded = 0;
 	}
 
 	SkCodec::Result decode(int* rowsDecoded) override {
+		this->processFrameData();
+
+		// Now apply Xforms on all the rows that were decoded. An OVER frame must be blended
+		// exactly once onto the untouched prior frame, so it is only written after the last
+		// pass. SOURCE frames show every pass as it arrives.
+		if (!fLinesDecoded || (this->blendsRows() && !fInterlacedComplete)) {
+			if (rowsDecoded) {
+				*rowsDecoded = 0;
+			}
+			return SkCodec::kIncompleteInput;
+		}
+
+		int rowsWrittenToOutput = 0;
+
+		// FIXME: For resuming interlace, we may swizzle a row that hasn't changed. But it
+		// may be too tricky/expensive to handle that correctly.
+
+		// The first row in fInterlaceBuffer corresponds to fFirstRow. Rows that sampling
+		// skips are not swizzled.
+		png_bytep srcRow = fInterlaceBuffer;
+		for (int rowNum = fFirstRow; rowNum <= fLastRow; rowNum++) {
+			if (this->writeFrameRow(fDst, fRowBytes, rowNum, srcRow)) {
+				rowsWrittenToOutput++;
+			}
+			srcRow = SkTAddOffset<png_byte>(srcRow, fPng_rowbytes);
+		}
+
+		if (fInterlacedComplete) {
+			return SkCodec::kSuccess;
+		}
+
+		if (rowsDecoded) {
+			*rowsDecoded = rowsWrittenToOutput;
+		}
 		return SkCodec::kIncompleteInput;
 	}
 
 	void setUpInterlaceBuffer(int height) {
 		fPng_rowbytes = png_get_rowbytes(this->png_ptr(), this->info_ptr());
-		fInterlaceBuffer.reset(fPng_rowbytes * height);
+		fInterlaceBuffer = (png_bytep)m_pScratchArena->get(SkAPngScratchArena::kInterlace_Slot, fPng_rowbytes * height);
 		fInterlacedComplete = false;
 	}
 };
@@ -241,40 +295,55 @@ SkAPngFrameDecoder::~SkAPngFrameDecoder()
 {
 }
 
-SkAPngFrameDecoder::SkAPngFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pStream, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex)
+SkAPngFrameDecoder::SkAPngFrameDecoder(const SkEncodedInfo& encodedInfo, const SkImageInfo& imageInfo, SkStream* pStream, SkAPngScratchArena* arena, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex)
 	: INHERITED(encodedInfo, imageInfo, nullptr, nullptr, png_ptr, info_ptr, pMainCodec->getBitDepth())
 	, m_pMainCodecStream(pStream)
+	, m_pScratchArena(arena)
 	, m_pMainCodec(pMainCodec)
 	, m_frameIndex(frameIndex)
+	, m_frameHeaderLen(0)
+	, m_frameHeaderIHDRPos(0)
+	, m_frameHeight(0)
+	, m_xformsReady(false)
+	, m_storageWidth(0)
+	, m_xformSubset(SkIRect::MakeEmpty())
+	, m_xformSampleX(1)
+	, m_liveSwizzler(-1)
+	, m_blockIndex(0)
+	, m_blockOffset(0)
+	, m_blockStarted(false)
+	, m_outputRect(SkIRect::MakeEmpty())
+	, m_regionOffsetY(0)
+	, m_sampleY(1)
+	, m_blendRows(false)
+	, m_blendRow(nullptr)
 {
 }
 
-static SkCodec::Result read_frame_header(png_structp* png_ptrp, png_infop* info_ptrp, SkAPngReader* pAPngReader, int frameIndex) {
+static SkCodec::Result read_frame_header(png_structp* png_ptrp, png_infop* info_ptrp, png_bytep frameHeader, size_t frameHeaderLen,
+	SkAPngScratchArena* arena) {
 	// The image is known to be a PNG. Decode enough to know the SkImageInfo.
-	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_structp png_ptr = (png_structp)arena->createReadStruct();
 	if (!png_ptr) {
 		return SkCodec::kInternalError;
 	}
 
 	png_infop info_ptr = png_create_info_struct(png_ptr);
 	if (info_ptr == nullptr) {
+		png_destroy_read_struct(&png_ptr, nullptr, nullptr);
 		return SkCodec::kInternalError;
 	}
 
 	if (setjmp(PNG_JMPBUF(png_ptr))) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
 		return SkCodec::kInvalidInput;
 	}
 
 	png_set_progressive_read_fn(png_ptr, nullptr, nullptr, nullptr, nullptr);
 
-	const SkFrame* frame = pAPngReader->getFrame(frameIndex);
-
 	png_set_crc_action(png_ptr, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
-	// parse png header
-	pAPngReader->setIHDR_w_h(frame->width(), frame->height());
-	png_bytep pAPngHeadData = (png_bytep)pAPngReader->getAPngHeadData();	
-	size_t lenAPngHeadData = pAPngReader->getAPngHeadDataLen();
-	png_process_data(png_ptr, info_ptr, pAPngHeadData, lenAPngHeadData);
+	// parse png header : signature, IHDR (with this frame's size), PLTE and tRNS only.
+	png_process_data(png_ptr, info_ptr, frameHeader, frameHeaderLen);
 
 	// set every frame's png_ptr
 	{
@@ -327,6 +396,8 @@ static SkCodec::Result read_frame_header(png_structp* png_ptrp, png_infop* info_
 			// All the color types have been covered above.
 			SkASSERT(false);
 		}
+
+		png_set_interlace_handling(png_ptr);
 	}
 
 	*png_ptrp = png_ptr;
@@ -335,90 +406,455 @@ static SkCodec::Result read_frame_header(png_structp* png_ptrp, png_infop* info_
 	return SkCodec::kSuccess;
 }
 
-SkCodec::Result SkAPngFrameDecoder::decodeFrame(const SkImageInfo& dstInfo, void* dst, const Options& options, size_t rowBytes, int* rowsDecoded)
+void SkAPngFrameDecoder::setFrameHeader(const SkAPngReader* pAPngReader)
 {
-	const SkFrame * frame = m_pMainCodec->getAPngReader()->getFrame(options.fFrameIndex);
-	SkImageInfo frameDstInfo = this->getInfo();
+	m_frameHeaderLen = pAPngReader->getAPngHeadDataLen();
+	m_frameHeader.reset(m_frameHeaderLen);
+	m_pScratchArena->countHeapAllocation();
+	memcpy(m_frameHeader.get(), pAPngReader->getAPngHeadData(), m_frameHeaderLen);
+	m_frameHeaderIHDRPos = pAPngReader->getIHDRDataPos();
+}
+
+SkCodec::Result SkAPngFrameDecoder::resetFrame(int frameIndex)
+{
+	const SkFrame* frame = m_pMainCodec->getAPngReader()->getFrame(frameIndex);
+	if (!frame) {
+		return kInvalidParameters;
+	}
+
+	this->destroyReadStruct();
 
-	Result result = this->initializeXforms(frameDstInfo, options);
+	// CRC errors are ignored for frame headers, so the IHDR can be patched without fixing its CRC.
+	png_save_uint_32(m_frameHeader.get() + m_frameHeaderIHDRPos, frame->width());
+	png_save_uint_32(m_frameHeader.get() + m_frameHeaderIHDRPos + 4, frame->height());
+	fRowWidth = frame->width();
+	m_frameHeight = frame->height();
+
+	png_structp png_ptr;
+	png_infop info_ptr;
+	Result result = read_frame_header(&png_ptr, &info_ptr, m_frameHeader.get(), m_frameHeaderLen, m_pScratchArena);
 	if (kSuccess != result) {
 		return result;
 	}
 
-	this->allocateStorage(frameDstInfo);
-	this->initializeXformParams();
-	//int frameRowBytes2 = frameDstInfo.minRowBytes();
-	int frameRowBytes = png_get_rowbytes(fPng_ptr, fInfo_ptr);
+	fPng_ptr = png_ptr;
+	fInfo_ptr = info_ptr;
+	m_frameIndex = frameIndex;
+	m_blockIndex = 0;
+	m_blockOffset = 0;
+	m_blockStarted = false;
+	return kSuccess;
+}
 
-	png_bytep frameDst = (png_bytep)malloc(frame->height() * frameRowBytes);
+// src-over of an unpremultiplied row onto an unpremultiplied row. Alpha is in the last byte
+// for both RGBA and BGRA, and the color channels are treated alike. As in blend_row_F16, a
+// pixel's channels are blended at once and divided by outA with one reciprocal.
+static void blend_row_unpremul_8888(uint8_t* dst, const uint8_t* src, int width) {
+	for (int x = 0; x < width; x++, dst += 4, src += 4) {
+		const unsigned srcA = src[3];
+		if (255 == srcA) {
+			memcpy(dst, src, 4);
+		} else if (srcA) {
+			const float sa = srcA * (1.0f / 255);
+			const float da = dst[3] * (1.0f / 255) * (1.0f - sa);
+			const float outA = sa + da;
+			const Sk4f s = SkNx_cast<float>(Sk4b::Load(src));
+			const Sk4f d = SkNx_cast<float>(Sk4b::Load(dst));
+			// Rounded, and at most 255 since it is a weighted mean of 8-bit values.
+			SkNx_cast<uint8_t>((s * sa + d * da) * (1.0f / outA) + 0.5f).store(dst);
+			dst[3] = (uint8_t)(outA * 255 + 0.5f);
+		}
+	}
+}
 
-	result = this->decodeAllRows(frameDst, frameRowBytes, rowsDecoded);
+static void blend_row_F16(uint64_t* dst, const uint64_t* src, int width, bool premul) {
+	for (int x = 0; x < width; x++) {
+		Sk4f s = SkHalfToFloat_finite_ftz(src[x]);
+		const float srcA = s[3];
+		if (srcA >= 1.0f) {
+			dst[x] = src[x];
+		} else if (srcA > 0.0f) {
+			Sk4f d = SkHalfToFloat_finite_ftz(dst[x]);
+			if (premul) {
+				d = s + d * (1.0f - srcA);
+			} else {
+				const float dstA = d[3] * (1.0f - srcA);
+				const float outA = srcA + dstA;
+				d = (s * srcA + d * dstA) * (1.0f / outA);
+				d = Sk4f(d[0], d[1], d[2], outA);
+			}
+			SkFloatToHalf_finite_ftz(d).store(&dst[x]);
+		}
+	}
+}
 
-	memset(dst, 0, dstInfo.height() * rowBytes);
-	int xStart = frame->frameRect().fLeft;
-	int yStart = frame->frameRect().fTop;
-	int xEnd = frame->frameRect().fRight;
-	int yEnd = frame->frameRect().fBottom;
+// Composites one decoded frame row over the prior frame (APNG_BLEND_OP_OVER).
+static void blend_row(const SkImageInfo& dstInfo, void* dst, const void* src, int width) {
+	switch (dstInfo.colorType()) {
+	case kRGBA_8888_SkColorType:
+	case kBGRA_8888_SkColorType:
+		if (kPremul_SkAlphaType == dstInfo.alphaType()) {
+			// SkBlitRow's S32A proc is SIMD and only depends on alpha being the high byte.
+			static const SkBlitRow::Proc32 proc = SkBlitRow::Factory32(SkBlitRow::kSrcPixelAlpha_Flag32);
+			proc((uint32_t*)dst, (const SkPMColor*)src, width, 0xFF);
+		} else {
+			blend_row_unpremul_8888((uint8_t*)dst, (const uint8_t*)src, width);
+		}
+		break;
+	case kRGBA_F16_SkColorType:
+		blend_row_F16((uint64_t*)dst, (const uint64_t*)src, width,
+			kPremul_SkAlphaType == dstInfo.alphaType());
+		break;
+	default:
+		// No alpha (565, gray), so OVER is the same as SOURCE.
+		memcpy(dst, src, width * dstInfo.bytesPerPixel());
+		break;
+	}
+}
 
-	for (int y = yStart; y < yEnd; y++)
-	{
-		memcpy((png_bytep)dst + (xStart * dstInfo.bytesPerPixel() + y * rowBytes), frameDst + (y - yStart) * frameRowBytes, frameRowBytes);
+// Composites one row of palette indices over the prior frame's: pixels whose entry is
+// fully transparent keep the prior index. Only valid without partially transparent entries.
+static void blend_index_row(uint8_t* dst, const uint8_t* src, int width, const uint8_t* paletteAlpha) {
+	for (int x = 0; x < width; x++) {
+		if (paletteAlpha[src[x]]) {
+			dst[x] = src[x];
+		}
 	}
+}
 
-	free(frameDst);
+bool SkAPngFrameDecoder::createColorTable(const SkImageInfo& dstInfo)
+{
+	fColorTable = m_pMainCodec->findSharedColorTable(dstInfo);
+	if (fColorTable) {
+		return true;
+	}
+	if (!INHERITED::createColorTable(dstInfo)) {
+		return false;
+	}
+	m_pScratchArena->countHeapAllocation();
+	m_pMainCodec->shareColorTable(dstInfo, fColorTable);
+	return true;
+}
+
+// Swizzlers only see one row at a time, so they are told apart by their row setup.
+static SkImageInfo swizzler_row_info(const SkImageInfo& info)
+{
+	return info.makeWH(info.width(), 1);
+}
+
+static SkIRect swizzler_columns(const SkIRect* subset)
+{
+	return subset ? SkIRect::MakeLTRB(subset->fLeft, 0, subset->fRight, 1) : SkIRect::MakeEmpty();
+}
 
+std::unique_ptr<SkSwizzler> SkAPngFrameDecoder::makeSwizzler(const SkImageInfo& swizzlerInfo, const Options& options,
+	bool skipFormatConversion)
+{
+	CachedSwizzler key;
+	key.m_info = swizzler_row_info(swizzlerInfo);
+	key.m_columns = swizzler_columns(options.fSubset);
+	key.m_skipFormatConversion = skipFormatConversion;
+	key.m_zeroInitialized = options.fZeroInitialized;
+	key.m_colors = get_color_ptr(fColorTable.get());
+	for (size_t i = 0; i < m_swizzlers.size(); i++) {
+		CachedSwizzler& entry = m_swizzlers[i];
+		if (entry.m_swizzler && entry.m_info == key.m_info && entry.m_columns == key.m_columns
+			&& entry.m_skipFormatConversion == key.m_skipFormatConversion
+			&& entry.m_zeroInitialized == key.m_zeroInitialized && entry.m_colors == key.m_colors) {
+			m_liveSwizzler = static_cast<int>(i);
+			return std::move(entry.m_swizzler);
+		}
+	}
+
+	std::unique_ptr<SkSwizzler> swizzler = INHERITED::makeSwizzler(swizzlerInfo, options, skipFormatConversion);
+	m_pScratchArena->countHeapAllocation();
+	m_liveSwizzler = static_cast<int>(m_swizzlers.size());
+	m_swizzlers.push_back(std::move(key));
+	return swizzler;
+}
+
+void SkAPngFrameDecoder::stashSwizzler()
+{
+	if (fSwizzler && m_liveSwizzler >= 0) {
+		m_swizzlers[m_liveSwizzler].m_swizzler = std::move(fSwizzler);
+	}
+	m_liveSwizzler = -1;
+}
+
+SkCodec::Result SkAPngFrameDecoder::prepareXforms(const SkImageInfo& frameDstInfo, const Options& options, int sampleX)
+{
+	const SkImageInfo rowInfo = swizzler_row_info(frameDstInfo);
+	const SkIRect columns = swizzler_columns(options.fSubset);
+	if (!m_xformsReady || rowInfo != m_xformDstInfo || columns != m_xformSubset || sampleX != m_xformSampleX) {
+		// Frames of another width take back their swizzler, the color table is shared and
+		// storage sized for a wider frame is kept, so only the first frame of each setup
+		// allocates.
+		this->stashSwizzler();
+		const SkColorSpaceXform* wideXform = fWideXform.get();
+		Options frameOptions = options;
+		frameOptions.fZeroInitialized = kNo_ZeroInitialized;
+		// Index decodes (A8 frameDstInfo, whole frames) copy rows as they are, and whole
+		// 16-bit RGB(A) rows go to F16 without being swizzled to 8 bits first.
+		const SkEncodedInfo::Color color = this->getEncodedInfo().color();
+		const bool wideRows = kRGBA_F16_SkColorType == frameDstInfo.colorType()
+			&& 16 == this->getEncodedInfo().bitsPerComponent()
+			&& (SkEncodedInfo::kRGB_Color == color || SkEncodedInfo::kRGBA_Color == color)
+			&& !options.fSubset && 1 == sampleX;
+		Result result;
+		if (m_pMainCodec->isIndexOutput()) {
+			result = this->initializeIndexXforms();
+		} else if (wideRows) {
+			result = this->initializeWideXforms(frameDstInfo);
+		} else {
+			result = this->initializeXforms(frameDstInfo, frameOptions);
+		}
+		if (kSuccess != result) {
+			return result;
+		}
+		if (fWideXform && fWideXform.get() != wideXform) {
+			m_pScratchArena->countHeapAllocation();
+		}
+		// A subset always gets a swizzler, so sampled decodes have one. A kept swizzler
+		// may have been sampled differently.
+		if (this->swizzler()) {
+			this->swizzler()->setSampleX(sampleX);
+		}
+		if (kColorOnly_XformMode == fXformMode || kSwizzleColor_XformMode == fXformMode) {
+			if (frameDstInfo.width() > m_storageWidth) {
+				this->allocateStorage(frameDstInfo);
+				m_storageWidth = frameDstInfo.width();
+				m_pScratchArena->countHeapAllocation();
+			}
+		}
+		m_xformDstInfo = rowInfo;
+		m_xformSubset = columns;
+		m_xformSampleX = sampleX;
+		m_xformsReady = true;
+	} else {
+		// Same frame width and setup as the frame before, so the swizzler, color table and
+		// storage are still valid. Only the new png_struct needs updating.
+		if (setjmp(PNG_JMPBUF(fPng_ptr))) {
+			return kInvalidInput;
+		}
+		png_read_update_info(fPng_ptr, fInfo_ptr);
+	}
+	return kSuccess;
+}
+
+bool SkAPngFrameDecoder::writeFrameRow(void* dst, size_t rowBytes, int frameRow, const void* src)
+{
+	// Row of the decoded region, kept if it is one of the rows sampling picks.
+	const int y = m_regionOffsetY + frameRow - get_start_coord(m_sampleY);
+	if (y < 0 || y % m_sampleY) {
+		return false;
+	}
+	const int outputRow = y / m_sampleY;
+	if (outputRow < m_outputRect.fTop || outputRow >= m_outputRect.fBottom) {
+		return false;
+	}
+
+	const size_t bpp = m_canvasInfo.bytesPerPixel();
+	dst = SkTAddOffset<void>(dst, outputRow * rowBytes + m_outputRect.fLeft * bpp);
+	if (m_blendRows) {
+		this->applyXformRow(m_blendRow, src);
+		if (m_pMainCodec->isIndexOutput()) {
+			blend_index_row((uint8_t*)dst, m_blendRow, m_outputRect.width(),
+				m_pMainCodec->paletteAlpha());
+		} else {
+			blend_row(m_canvasInfo, dst, m_blendRow, m_outputRect.width());
+		}
+	} else {
+		this->applyXformRow(dst, src);
+	}
+	return true;
+}
+
+SkIRect SkAPngFrameDecoder::SampledFrameRect(const SkIRect& frameRect, const SkIRect& region, int sampleX, int sampleY)
+{
+	SkIRect visible = frameRect;
+	if (!visible.intersect(region)) {
+		return SkIRect::MakeEmpty();
+	}
+
+	// Output row j holds region row get_start_coord(sampleY) + j * sampleY.
+	const int top = visible.fTop - region.fTop - get_start_coord(sampleY);
+	const int bottom = visible.fBottom - region.fTop - get_start_coord(sampleY);
+	SkIRect rect;
+	rect.fLeft = (visible.fLeft - region.fLeft) / sampleX;
+	rect.fRight = std::min(get_scaled_dimension(region.width(), sampleX),
+		rect.fLeft + get_scaled_dimension(visible.width(), sampleX));
+	rect.fTop = top > 0 ? (top + sampleY - 1) / sampleY : 0;
+	rect.fBottom = bottom > 0 ? std::min(get_scaled_dimension(region.height(), sampleY),
+		(bottom + sampleY - 1) / sampleY) : 0;
+	if (rect.isEmpty()) {
+		return SkIRect::MakeEmpty();
+	}
+	return rect;
+}
+
+SkCodec::Result SkAPngFrameDecoder::startFrameDecode(const SkImageInfo& dstInfo, void* dst, size_t rowBytes, const Options& options,
+	int sampleX, int sampleY)
+{
+	const SkFrame * frame = m_pMainCodec->getAPngReader()->getFrame(m_frameIndex);
+	const SkIRect frameRect = frame->frameRect();
+	const SkIRect canvas = SkIRect::MakeWH(dstInfo.width(), dstInfo.height());
+	if (!canvas.contains(frameRect)) {
+		return kInvalidInput;
+	}
+
+	const SkIRect region = options.fSubset ? *options.fSubset : canvas;
+	m_canvasInfo = dstInfo;
+	m_outputRect = SampledFrameRect(frameRect, region, sampleX, sampleY);
+	m_regionOffsetY = frameRect.fTop - region.fTop;
+	m_sampleY = sampleY;
+	if (m_outputRect.isEmpty()) {
+		// Nothing of this frame shows; continueFrameDecode succeeds without inflating.
+		return kSuccess;
+	}
+
+	// Only the frame columns that land in dst are swizzled. A visible span narrower than
+	// sampleX keeps its middle pixel.
+	SkIRect visible = frameRect;
+	visible.intersect(region);
+	const int frameSampleX = std::min(sampleX, visible.width());
+	SkIRect columns = SkIRect::MakeXYWH(visible.fLeft - frameRect.fLeft, 0,
+		std::min(visible.width(), m_outputRect.width() * frameSampleX), frame->height());
+	Options frameOptions = options;
+	frameOptions.fSubset = nullptr;
+	if (columns.width() != frame->width() || 1 != frameSampleX) {
+		frameOptions.fSubset = &columns;
+	}
+
+	Result result = this->prepareXforms(dstInfo.makeWH(frame->width(), frame->height()), frameOptions, frameSampleX);
+	if (kSuccess != result) {
+		return result;
+	}
+
+	// Rows go straight into dst, blended one at a time for OVER frames.
+	m_blendRows = SkCodecAnimation::Blend::kPriorFrame == frame->getBlend()
+		&& kNone != frame->getRequiredFrame()
+		&& kOpaque_SkAlphaType != dstInfo.alphaType();
+	if (m_blendRows) {
+		if (m_pMainCodec->isIndexOutput() && m_pMainCodec->paletteHasPartialAlpha()) {
+			// Blending partially transparent entries makes colors the palette lacks.
+			return kUnimplemented;
+		}
+		m_blendRow = (uint8_t*)m_pScratchArena->get(SkAPngScratchArena::kBlendRow_Slot,
+			m_outputRect.width() * dstInfo.bytesPerPixel());
+	}
+
+	// Inflating stops after the frame row of the last output row.
+	const int firstRow = region.fTop + get_start_coord(sampleY) + m_outputRect.fTop * sampleY - frameRect.fTop;
+	const int lastRow = region.fTop + get_start_coord(sampleY) + (m_outputRect.fBottom - 1) * sampleY - frameRect.fTop;
+	this->setRange(firstRow, lastRow, dst, rowBytes);
+	return kSuccess;
+}
+
+SkCodec::Result SkAPngFrameDecoder::continueFrameDecode(int* rowsDecoded)
+{
+	if (m_outputRect.isEmpty()) {
+		return kSuccess;
+	}
+
+	// FIXME: Only necessary on the first call.
+	this->initializeXformParams();
+
+	int frameRowsDecoded = 0;
+	const Result result = this->decode(&frameRowsDecoded);
+	if (kIncompleteInput == result && rowsDecoded) {
+		// Rows above the frame rect hold the prior frame and are already complete.
+		*rowsDecoded = m_outputRect.fTop + frameRowsDecoded;
+	}
 	return result;
 }
 
-std::unique_ptr<SkAPngFrameDecoder> SkAPngFrameDecoder::MakeFrameDecoder(SkStream* stream, Result* result, SkAPngCodec* pMainCodec, int frameIndex)
+SkCodec::Result SkAPngFrameDecoder::decodeFrame(const SkImageInfo& dstInfo, void* dst, const Options& options, size_t rowBytes, int* rowsDecoded)
 {
-	SkAPngFrameDecoder* outCodec = nullptr;
+	// The caller (or SkAPngCodec) has already put the required frame, disposed, in dst.
+	// Rows are decoded straight into the frame rect of dst, so nothing outside it is
+	// touched and no frame-sized buffer is needed.
+	Options frameOptions = options;
+	frameOptions.fSubset = nullptr;
+	Result result = this->startFrameDecode(dstInfo, dst, rowBytes, frameOptions, 1, 1);
+	if (kSuccess != result) {
+		return result;
+	}
+
+	int rowsWritten = dstInfo.height();
+	result = this->continueFrameDecode(&rowsWritten);
+	if (kIncompleteInput != result) {
+		return result;
+	}
 
-	if (pMainCodec)
+	// Rows that were never received replace the prior frame with transparent, unless the
+	// frame is blended over it. SkCodec must not fill anything outside the frame.
+	if (!m_blendRows) {
+		const SkIRect missing = SkIRect::MakeLTRB(m_outputRect.fLeft, std::max(rowsWritten, m_outputRect.fTop),
+			m_outputRect.fRight, m_outputRect.fBottom);
+		const size_t bpp = dstInfo.bytesPerPixel();
+		const uint8_t clear = m_pMainCodec->isIndexOutput() ? m_pMainCodec->clearIndex() : 0;
+		void* dstRow = SkTAddOffset<void>(dst, missing.fTop * rowBytes + missing.fLeft * bpp);
+		for (int y = missing.fTop; y < missing.fBottom; y++) {
+			memset(dstRow, clear, missing.width() * bpp);
+			dstRow = SkTAddOffset<void>(dstRow, rowBytes);
+		}
+	}
+	if (rowsDecoded) {
+		*rowsDecoded = dstInfo.height();
+	}
+	return result;
+}
+
+std::unique_ptr<SkAPngFrameDecoder> SkAPngFrameDecoder::MakeFrameDecoder(SkStream* stream, SkAPngScratchArena* arena, Result* result, SkAPngCodec* pMainCodec, int frameIndex)
+{
+	std::unique_ptr<SkAPngFrameDecoder> outCodec;
+
+	if (pMainCodec && pMainCodec->getAPngReader())
 	{
-		png_structp png_ptr;
-		png_infop info_ptr;
+		SkAPngReader* pAPngReader = pMainCodec->getAPngReader();
+		const SkFrame* frame = pAPngReader->getFrame(frameIndex);
+		if (!frame) {
+			*result = kInvalidParameters;
+			return nullptr;
+		}
 
-		if (kSuccess != read_frame_header(&png_ptr, &info_ptr, pMainCodec->getAPngReader(), frameIndex)) {
-			*result = kErrorInInput;
+		// The kept decoder shares the codec's stream; parallel decodes pass their own.
+		SkStream * frameStream = stream;
+		SkEncodedInfo encodedInfo = pMainCodec->getEncodedInfo();
+		SkImageInfo imageInfo = pMainCodec->getInfo();
+		// The decoder's info is the canvas; resetFrame sizes it for each frame.
+		SkImageInfo frameImageInfo = imageInfo;
+		int bitDepth = pMainCodec->getBitDepth();
+
+		int decodeType = (int)pAPngReader->getFrameDecoderType();
+		if (E_Normal_Decoder == decodeType)
+		{
+			outCodec.reset(new SkAPngNormalFrameDecoder(encodedInfo, frameImageInfo, frameStream, arena, nullptr, nullptr, bitDepth, pMainCodec, frameIndex));
+		}
+		else if (E_Interlaced_Decoder == decodeType)
+		{
+			int numPasses = pAPngReader->getNumberPasses();
+			outCodec.reset(new SkAPngInterlacedFrameDecoder(encodedInfo, frameImageInfo, frameStream, arena, nullptr, nullptr, bitDepth, numPasses, pMainCodec, frameIndex));
 		}
 
-		if (pMainCodec->getAPngReader())
+		if (outCodec)
 		{
-			int decodeType = (int)pMainCodec->getAPngReader()->getFrameDecoderType();
-			if (E_Normal_Decoder == decodeType)
-			{
-				SkStream * frameStream = pMainCodec->makeFrameStream(frameIndex);
-				SkEncodedInfo encodedInfo = pMainCodec->getEncodedInfo();
-				SkImageInfo imageInfo = pMainCodec->getInfo();
-				const SkFrame* frame = pMainCodec->getAPngReader()->getFrame(frameIndex);
-				int frameW = frame->width();
-				int frameH = frame->height();
-				SkImageInfo frameImageInfo = SkImageInfo::Make(frameW, frameH, imageInfo.colorType(), imageInfo.alphaType(), imageInfo.refColorSpace());
-				int bitDepth = pMainCodec->getBitDepth();
-				outCodec = new SkAPngNormalFrameDecoder(encodedInfo, frameImageInfo, frameStream, png_ptr, info_ptr, bitDepth, pMainCodec, frameIndex);
-			}
-			else if (E_Interlaced_Decoder == decodeType)
-			{
-				SkStream * frameStream = pMainCodec->makeFrameStream(frameIndex);
-				SkEncodedInfo encodedInfo = pMainCodec->getEncodedInfo();
-				SkImageInfo imageInfo = pMainCodec->getInfo();
-				const SkFrame* frame = pMainCodec->getAPngReader()->getFrame(frameIndex);
-				int frameW = frame->width();
-				int frameH = frame->height();
-				int numPasses = pMainCodec->getAPngReader()->getNumberPasses();
-				SkImageInfo frameImageInfo = SkImageInfo::Make(frameW, frameH, imageInfo.colorType(), imageInfo.alphaType(), imageInfo.refColorSpace());
-				int bitDepth = pMainCodec->getBitDepth();
-				outCodec = new SkAPngInterlacedFrameDecoder(encodedInfo, frameImageInfo, frameStream, png_ptr, info_ptr, bitDepth, numPasses, pMainCodec, frameIndex);
+			arena->countHeapAllocation();
+			outCodec->setFrameHeader(pAPngReader);
+			if (kSuccess != outCodec->resetFrame(frameIndex)) {
+				*result = kErrorInInput;
+				return nullptr;
 			}
 		}
 	}
 
-	return std::unique_ptr<SkAPngFrameDecoder>(outCodec);
+	if (!outCodec) {
+		*result = kInternalError;
+	}
+	return outCodec;
 }
 
-void SkAPngFrameDecoder::processfdATData(size_t fdATPos, size_t fdATLength) {
-	m_pMainCodecStream->seek(fdATPos);
+void SkAPngFrameDecoder::processFrameData() {
 	switch (setjmp(PNG_JMPBUF(fPng_ptr))) {
 	case kPngError:
 		// There was an error. Stop processing data.
@@ -439,23 +875,58 @@ void SkAPngFrameDecoder::processfdATData(size_t fdATPos, size_t fdATLength) {
 	constexpr size_t kBufferSize = 4096;
 	char buffer[kBufferSize];
 
-	size_t fIdatLength = fdATLength;
-
-	bool iend = false;
+	// For memory-backed streams, fdAT data is handed to libpng in place by block offset,
+	// without seeking or copying.
+	const png_byte* memoryBase = (const png_byte*)m_pMainCodecStream->getMemoryBase();
+	const size_t memoryLength = memoryBase && m_pMainCodecStream->hasLength() ? m_pMainCodecStream->getLength() : 0;
+	if (!memoryLength) {
+		memoryBase = nullptr;
+	}
 
-	// process fake IDAT header
-	png_byte idat[] = { 0, 0, 0, 0, 'I', 'D', 'A', 'T' };
-	png_save_uint_32(idat, fIdatLength);
-	png_process_data(fPng_ptr, fInfo_ptr, idat, 8);
+	// m_blockIndex/m_blockOffset record how much has been fed to libpng, so an incremental
+	// decode picks up exactly where the previous call ran out of data. Blocks of this frame
+	// found by later scans are appended to the same vector.
+	const std::vector<SkAPngFrameBlock>* blocks = m_pMainCodec->getAPngReader()->frameContext(m_frameIndex)->getIDATBlocks();
+	while (m_blockIndex < blocks->size()) {
+		const SkAPngFrameBlock& block = (*blocks)[m_blockIndex];
+		if (!m_blockStarted) {
+			// process fake IDAT header
+			png_byte idat[] = { 0, 0, 0, 0, 'I', 'D', 'A', 'T' };
+			png_save_uint_32(idat, block.blockSize);
+			m_blockStarted = true;
+			png_process_data(fPng_ptr, fInfo_ptr, idat, 8);
+		}
 
-	// process fdAT data
-	while (fIdatLength > 0) {
-		const size_t bytesToProcess = std::min(kBufferSize, fIdatLength);
-		const size_t bytesRead = m_pMainCodecStream->read(buffer, bytesToProcess);
-		png_process_data(fPng_ptr, fInfo_ptr, (png_bytep)buffer, bytesRead);
-		if (bytesRead < bytesToProcess) {
+		// process fdAT data
+		if (memoryBase) {
+			const size_t start = block.blockPosition + m_blockOffset;
+			const size_t bytes = start < memoryLength
+				? std::min(block.blockSize - m_blockOffset, memoryLength - start) : 0;
+			m_blockOffset += bytes;
+			png_process_data(fPng_ptr, fInfo_ptr, (png_bytep)(memoryBase + start), bytes);
+			if (m_blockOffset < block.blockSize) {
+				return;
+			}
+		}
+		else if (!m_pMainCodecStream->seek(block.blockPosition + m_blockOffset)) {
 			return;
 		}
-		fIdatLength -= bytesToProcess;
+		while (m_blockOffset < block.blockSize) {
+			const size_t bytesToProcess = std::min(kBufferSize, block.blockSize - m_blockOffset);
+			const size_t bytesRead = m_pMainCodecStream->read(buffer, bytesToProcess);
+			m_blockOffset += bytesRead;
+			png_process_data(fPng_ptr, fInfo_ptr, (png_bytep)buffer, bytesRead);
+			if (bytesRead < bytesToProcess) {
+				return;
+			}
+		}
+
+		// Frame decoders ignore CRCs (PNG_CRC_QUIET_USE), but libpng still expects four
+		// CRC bytes before the next chunk.
+		png_byte crc[] = { 0, 0, 0, 0 };
+		m_blockIndex++;
+		m_blockOffset = 0;
+		m_blockStarted = false;
+		png_process_data(fPng_ptr, fInfo_ptr, crc, 4);
 	}
 }
@@ -11,23 +11,118 @@
 
 class SkAPngReader;
 class SkAPngCodec;
+class SkAPngScratchArena;
 class SkAPngFrameDecoder : public SkPngCodec {
 public:
 	~SkAPngFrameDecoder() override;
 
-	static std::unique_ptr<SkAPngFrameDecoder> MakeFrameDecoder(SkStream* stream, Result*, SkAPngCodec* pMainCodec, int frameIndex);
+	// Frame data is read from stream, which only this decoder may move while it decodes.
+	// Scratch buffers and libpng's memory come from arena, which must outlive the decoder.
+	static std::unique_ptr<SkAPngFrameDecoder> MakeFrameDecoder(SkStream* stream, SkAPngScratchArena* arena, Result*,
+		SkAPngCodec* pMainCodec, int frameIndex);
 
 	SkCodec::Result decodeFrame(const SkImageInfo& dstInfo, void* dst, const Options& options, size_t rowBytes, int* rowsDecoded);
 
+	// Incremental decoding of this frame into dst, which must already hold the frame it is
+	// drawn over (see SkAPngCodec::prepareFrameCanvas). dstInfo is the canvas; dst holds
+	// options.fSubset (or the canvas) keeping every sampleX-th column and sampleY-th row.
+	// continueFrameDecode resumes from the last fdAT byte given to libpng; rowsDecoded
+	// counts rows of dst.
+	Result startFrameDecode(const SkImageInfo& dstInfo, void* dst, size_t rowBytes, const Options& options,
+		int sampleX, int sampleY);
+	Result continueFrameDecode(int* rowsDecoded);
+
+	// The part of a sampled region that frameRect is drawn to. Rows are the ones sampling
+	// the whole region keeps; columns start at the sampled left edge of the frame, as
+	// SkSwizzler places GIF frames.
+	static SkIRect SampledFrameRect(const SkIRect& frameRect, const SkIRect& region, int sampleX, int sampleY);
+
+	int frameIndex() const { return m_frameIndex; }
+
+	// Points this decoder at another frame, of any size. Only the png_struct is rebuilt,
+	// from the decoder's own copy of the compact frame header with the IHDR size patched,
+	// in memory the scratch arena recycles. The color table is kept, each frame width gets
+	// back the swizzler it had before, and storage only grows.
+	Result resetFrame(int frameIndex);
+
 protected:
-	SkAPngFrameDecoder(const SkEncodedInfo&, const SkImageInfo&, SkStream* pStream, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex);
+	SkAPngFrameDecoder(const SkEncodedInfo&, const SkImageInfo&, SkStream* pStream, SkAPngScratchArena* arena, void* png_ptr, void* info_ptr, int bitDepth, SkAPngCodec* pMainCodec, int frameIndex);
+
+	// Feeds the current frame's fdAT blocks to libpng, resuming where the previous call stopped.
+	void processFrameData();
+
+	// Sets up swizzler/color xform for frameDstInfo, swizzling options.fSubset (frame
+	// columns) every sampleX-th pixel, or only updates the png_struct when the previous
+	// frame already set them up the same way.
+	Result prepareXforms(const SkImageInfo& frameDstInfo, const Options& options, int sampleX);
+
+	// Adopts the main codec's color table for dstInfo, building and sharing it if needed.
+	bool createColorTable(const SkImageInfo& dstInfo) override;
 
-	void processfdATData(size_t fdATPos, size_t fdATLength);
+	// Takes a kept swizzler made for the same row setup, or creates one and keeps an entry
+	// for it.
+	std::unique_ptr<SkSwizzler> makeSwizzler(const SkImageInfo& swizzlerInfo, const Options& options,
+		bool skipFormatConversion) override;
+	// Moves fSwizzler back to its entry, before the xforms are set up again.
+	void stashSwizzler();
+
+	// Writes frame row frameRow into dst if sampling keeps it, blending it for
+	// APNG_BLEND_OP_OVER frames. Returns whether the row was written.
+	bool writeFrameRow(void* dst, size_t rowBytes, int frameRow, const void* src);
+	bool blendsRows() const { return m_blendRows; }
+	int frameRowsNeeded() const { return m_outputRect.height(); }
+
+	// Copies the main codec's compact frame header. resetFrame sets its IHDR size.
+	void setFrameHeader(const SkAPngReader* pAPngReader);
 	
 	SkStream * m_pMainCodecStream;
+	SkAPngScratchArena* m_pScratchArena;
 	SkAPngCodec* m_pMainCodec;
 	int m_frameIndex;
 
+	SkAutoTMalloc<uint8_t> m_frameHeader;
+	size_t m_frameHeaderLen;
+	size_t m_frameHeaderIHDRPos;
+	// Height of the current frame; its width is fRowWidth. getInfo() is the canvas.
+	int m_frameHeight;
+	bool m_xformsReady;
+	// Frame width fStorage was allocated for, or 0.
+	int m_storageWidth;
+	// What the xforms were last set up for, rows left out: one row of the frame dst info,
+	// and the subset columns (empty without a subset).
+	SkImageInfo m_xformDstInfo;
+	SkIRect m_xformSubset;
+	int m_xformSampleX;
+
+	// Swizzlers of the row setups seen so far, since frames of different widths take turns.
+	// An entry is empty while its swizzler is fSwizzler.
+	struct CachedSwizzler {
+		SkImageInfo m_info;
+		SkIRect m_columns;
+		bool m_skipFormatConversion;
+		ZeroInitialized m_zeroInitialized;
+		const SkPMColor* m_colors;
+		std::unique_ptr<SkSwizzler> m_swizzler;
+	};
+	std::vector<CachedSwizzler> m_swizzlers;
+	// Entry fSwizzler belongs to, or -1.
+	int m_liveSwizzler;
+
+	// fdAT feeding progress for the current frame.
+	size_t m_blockIndex;
+	size_t m_blockOffset;
+	bool m_blockStarted;
+
+	// Row output for incremental decodes: the frame's rect in dst, and the frame's top
+	// relative to the decoded region.
+	SkImageInfo m_canvasInfo;
+	SkIRect m_outputRect;
+	int m_regionOffsetY;
+	int m_sampleY;
+	bool m_blendRows;
+	// Borrowed from the scratch arena for the current frame.
+	uint8_t* m_blendRow;
+
 private:
 
     typedef SkPngCodec INHERITED;
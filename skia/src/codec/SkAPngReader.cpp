@@ -7,8 +7,12 @@
 
 #include "SkBitmap.h"
 #include "SkAPngReader.h"
+#include "SkOpts.h"
 #include "SkPngCodec.h"
 
+#include <algorithm>
+#include <stdint.h>
+
 const unsigned long cMaxPNGSize = 1000000UL;
 
 // FIXME (scroggo): We can use png_jumpbuf directly once Google3 is on 1.6
@@ -18,6 +22,9 @@ SkAPngFrameContext::SkAPngFrameContext(SkAPngReader* reader, int id)
 	: INHERITED(id)
 	, m_owner(reader)
 	, m_isComplete(false)
+	, m_fcTLPosition(0)
+	, m_fcTLHash(0)
+	, m_fcTLVerified(true)
 {
 	setRequiredFrame(SkCodec::kNone);
 }
@@ -25,6 +32,10 @@ SkAPngFrameContext::~SkAPngFrameContext()
 {
 	
 }
+bool SkAPngFrameContext::onReportsAlpha() const
+{
+	return m_owner->hasAlpha();
+}
 
 ///////////////////////////////////////////////////////////////////////////////
 // apng chunk reader
@@ -35,8 +46,13 @@ SkAPngReader::SkAPngReader()
 	, m_totalFrames(0)
 	, m_sequenceNumber(0)
 	, m_decodeType(E_Normal_Decoder)
-	, m_bNeedParseFrameInfo(true)
+	, m_posIDHRData(0)
 	, m_apngHeaderData(nullptr)
+	, m_apngHeaderDataLen(0)
+	, m_bNeedParseFrameInfo(true)
+	, m_bHasAlpha(true)
+	, m_nextChunkPos(0)
+	, m_bParseComplete(false)
 {
 
 }
@@ -82,30 +98,28 @@ const SkFrame* SkAPngReader::onGetFrame(int i) const {
 	return static_cast<const SkFrame*>(this->frameContext(i));
 }
 
-bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * tag)
+constexpr size_t SkAPngReader::kMaxFrameInfoBytes;
+
+// Returns false on bad data. Before the first IDAT that makes the image static; after it,
+// parseFrames() keeps the frames found so far.
+bool SkAPngReader::parseFrameInfos(const png_byte* data, size_t dataPosition, int length, const char * tag)
 {
 	if (!memcmp(tag, "acTL", 4) && length == 8) 
 	{	
-		char acTLBuf[8];
-		stream->read(acTLBuf, 8);
-		stream->move(-8);
-		m_frameCount = png_get_uint_32((png_byte*)acTLBuf);
-		m_playCount = png_get_uint_32((png_byte*)acTLBuf + 4);
+		const png_byte* acTLBuf = data;
+		m_frameCount = png_get_uint_32(acTLBuf);
+		m_playCount = png_get_uint_32(acTLBuf + 4);
 
 		if (!m_frameCount || m_frameCount > PNG_UINT_31_MAX || m_playCount > PNG_UINT_31_MAX) {
-			fallbackNotAnimated();
 			return false;
 		}
 	}
 	if (!memcmp(tag, "fcTL", 4) && length == 26) 
 	{
-		char fcTLBuf[26];
-		stream->read(fcTLBuf, 26);
-		stream->move(-26);
+		const png_byte* fcTLBuf = data;
 
-		unsigned sequenceNumber = png_get_uint_32((png_byte*)fcTLBuf);
+		unsigned sequenceNumber = png_get_uint_32(fcTLBuf);
 		if (sequenceNumber != m_sequenceNumber++) {
-			fallbackNotAnimated();
 			return false;
 		}
 
@@ -118,8 +132,8 @@ bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * ta
 		int m_dispose;
 		int m_blend;
 
-		m_width = png_get_uint_32((png_byte*)fcTLBuf + 4);
-		m_height = png_get_uint_32((png_byte*)fcTLBuf + 8);
+		m_width = png_get_uint_32(fcTLBuf + 4);
+		m_height = png_get_uint_32(fcTLBuf + 8);
 
 		if (sequenceNumber == 0)
 		{
@@ -127,14 +141,16 @@ bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * ta
 			fScreenHeight = m_height;
 		}
 
-		m_xOffset = png_get_uint_32((png_byte*)fcTLBuf + 12);
-		m_yOffset = png_get_uint_32((png_byte*)fcTLBuf + 16);
-		m_delayNumerator = png_get_uint_16((png_byte*)fcTLBuf + 20);
-		m_delayDenominator = png_get_uint_16((png_byte*)fcTLBuf + 22);
-		m_dispose = ((png_byte*)fcTLBuf)[24];
-		m_blend = ((png_byte*)fcTLBuf)[25];		
+		m_xOffset = png_get_uint_32(fcTLBuf + 12);
+		m_yOffset = png_get_uint_32(fcTLBuf + 16);
+		m_delayNumerator = png_get_uint_16(fcTLBuf + 20);
+		m_delayDenominator = png_get_uint_16(fcTLBuf + 22);
+		m_dispose = fcTLBuf[24];
+		m_blend = fcTLBuf[25];		
 
-		// 
+		// a new fcTL ends the previous frame's data.
+		if (!m_frames.empty())
+			m_frames.back()->setComplete();
 		addFrameIfNecessary();
 
 		if (m_totalFrames < (int)(m_frames.size())) {
@@ -151,7 +167,10 @@ bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * ta
 			sprintf(buf, "fcTL-sequence:%d,w(%d),h(%d),d(%d)\n", m_totalFrames, m_width, m_height, duration);
 			//OutputDebugStringA(buf);
 
-			if (m_dispose == 2)
+			// APNG_DISPOSE_OP_PREVIOUS on the first frame is treated as APNG_DISPOSE_OP_BACKGROUND.
+			if (m_dispose == 2 && m_totalFrames == 0)
+				buffer->setDisposalMethod(SkCodecAnimation::DisposalMethod::kRestoreBGColor);
+			else if (m_dispose == 2)
 				buffer->setDisposalMethod(SkCodecAnimation::DisposalMethod::kRestorePrevious);
 			else if (m_dispose == 1)
 				buffer->setDisposalMethod(SkCodecAnimation::DisposalMethod::kRestoreBGColor);
@@ -159,6 +178,8 @@ bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * ta
 				buffer->setDisposalMethod(SkCodecAnimation::DisposalMethod::kKeep);
 
 			buffer->setXYWH(m_xOffset, m_yOffset, m_width, m_height);
+			buffer->m_fcTLPosition = dataPosition;
+			buffer->m_fcTLHash = SkOpts::hash(fcTLBuf, 26);
 
 			if (m_blend)
 				buffer->setBlend(SkCodecAnimation::Blend::kPriorFrame);
@@ -167,33 +188,116 @@ bool SkAPngReader::parseFrameInfos(SkStream* stream, int length, const char * ta
 
 			setAlphaAndRequiredFrame(buffer);
 		}
-		m_frames.back()->setComplete();
-
 		m_totalFrames++;
 	}
 	if (!memcmp(tag, "fdAT", 4) && length >= 4) 
 	{
-		char fdATBuf[4];
-		stream->read(fdATBuf, 4);
-		stream->move(-4);
+		const png_byte* fdATBuf = data;
 
-		unsigned sequenceNumber = png_get_uint_32((png_byte*)fdATBuf);
+		unsigned sequenceNumber = png_get_uint_32(fdATBuf);
 		if (sequenceNumber != m_sequenceNumber++) {
-			fallbackNotAnimated();
 			return false;
 		}
 
+		if (m_frames.empty()) {
+			return false;
+		}
 		SkAPngFrameContext* frame = m_frames.back().get();
-		frame->addAPngFrameBlock(stream->getPosition() + 4, length - 4);
+		frame->addAPngFrameBlock(dataPosition + 4, length - 4);
 		
 	}
 	return true;
 }
 
-void SkAPngReader::setIHDR_w_h(int width, int height)
+bool SkAPngReader::parseNextChunk(const png_byte header[8], const png_byte* data, size_t streamLength)
+{
+	const size_t length = png_get_uint_32(header);
+	// a corrupt length would wrap m_nextChunkPos on 32-bit builds and parse the same chunk
+	// forever.
+	if (length > PNG_UINT_31_MAX || 12 + length > SIZE_MAX - m_nextChunkPos)
+	{
+		m_bParseComplete = true;
+		return false;
+	}
+	// stop at a partial chunk and retry it once more data has arrived.
+	if (streamLength && (streamLength < m_nextChunkPos + 12 || length > streamLength - m_nextChunkPos - 12))
+		return false;
+
+	const char* tag = (const char*)header + 4;
+	if (!memcmp(tag, "IEND", 4))
+	{
+		if (!m_frames.empty())
+			m_frames.back()->setComplete();
+		m_bParseComplete = true;
+		return false;
+	}
+
+	if (!parseFrameInfos(data, m_nextChunkPos + 8, (int)length, tag))
+	{
+		m_bParseComplete = true;
+		return false;
+	}
+
+	m_nextChunkPos += 12 + length;
+	return true;
+}
+
+void SkAPngReader::parseFrames(SkStream* stream, int untilFrame, size_t availableEnd)
 {
-	png_save_uint_32(m_apngHeaderData + m_posIDHRData, width);
-	png_save_uint_32(m_apngHeaderData + m_posIDHRData + 4, height);
+	// frame i is fully known once the fcTL of frame i + 1 (or IEND) has been seen.
+	auto frameKnown = [this, untilFrame]() {
+		return untilFrame >= 0 && untilFrame + 1 < static_cast<int>(m_frames.size());
+	};
+	if (m_bParseComplete || frameKnown())
+		return;
+
+	// memory-backed streams (SkData::MakeFromFileName maps the file) are addressed by
+	// offset: only the pages holding chunk headers are touched, and the stream position,
+	// which the main codec uses, is left alone.
+	const png_byte* memoryBase = (const png_byte*)stream->getMemoryBase();
+	if (memoryBase && stream->hasLength())
+	{
+		const size_t memoryLength = stream->getLength();
+		while (!m_bParseComplete && !frameKnown() && m_nextChunkPos + 8 <= memoryLength)
+		{
+			const png_byte* chunk = memoryBase + m_nextChunkPos;
+			if (!parseNextChunk(chunk, chunk + 8, memoryLength))
+				break;
+		}
+		return;
+	}
+
+	size_t streamLength = stream->hasLength() ? stream->getLength() : 0;
+	if (availableEnd && (!streamLength || availableEnd < streamLength))
+		streamLength = availableEnd;
+	if (availableEnd && m_nextChunkPos + 8 > availableEnd)
+		return;
+
+	// frame decoders and the main codec share the stream, so leave it where it was.
+	const size_t savedPosition = stream->getPosition();
+	if (!stream->seek(m_nextChunkPos))
+		return;
+
+	png_byte chunk[8 + kMaxFrameInfoBytes];
+	while (!m_bParseComplete && !frameKnown())
+	{
+		if ((availableEnd && m_nextChunkPos + 8 > availableEnd) || stream->read(chunk, 8) < 8)
+			break;
+
+		// only the bytes parseFrameInfos() looks at are read; the rest is skipped.
+		const size_t length = png_get_uint_32(chunk);
+		const size_t infoBytes = std::min(length, kMaxFrameInfoBytes);
+		if (availableEnd && 12 + length > availableEnd - m_nextChunkPos)
+			break;
+		if (stream->read(chunk + 8, infoBytes) < infoBytes)
+			break;
+		if (!parseNextChunk(chunk, chunk + 8, streamLength))
+			break;
+		if (stream->skip(length - infoBytes + 4) < length - infoBytes + 4)
+			break;
+	}
+
+	stream->seek(savedPosition);
 }
 
 void SkAPngReader::setAPngHeadData(void* apngHeaderData, int len, size_t pos)
@@ -201,8 +305,28 @@ void SkAPngReader::setAPngHeadData(void* apngHeaderData, int len, size_t pos)
 	if (m_apngHeaderData)
 		DestroyAPngHeaderData(m_apngHeaderData);
 	m_apngHeaderData = (png_bytep)apngHeaderData;
-	m_apngHeaderDataLen = len;
 	m_posIDHRData = pos;
+
+	// Only the signature, IHDR, PLTE and tRNS affect how frame data is unpacked. Everything
+	// else (iCCP, text, acTL, the first fcTL, ...) is already reflected in the main codec,
+	// so compact the header in place and drop the rest.
+	size_t dstPos = 8;
+	for (size_t srcPos = 8; srcPos + 12 <= (size_t)len; )
+	{
+		const size_t chunkLen = png_get_uint_32(m_apngHeaderData + srcPos) + 12;
+		if (chunkLen > (size_t)len - srcPos)
+			break;
+		const png_byte* tag = m_apngHeaderData + srcPos + 4;
+		if (!memcmp(tag, "IHDR", 4) || !memcmp(tag, "PLTE", 4) || !memcmp(tag, "tRNS", 4))
+		{
+			if (!memcmp(tag, "IHDR", 4))
+				m_posIDHRData = dstPos + 8;
+			memmove(m_apngHeaderData + dstPos, m_apngHeaderData + srcPos, chunkLen);
+			dstPos += chunkLen;
+		}
+		srcPos += chunkLen;
+	}
+	m_apngHeaderDataLen = dstPos;
 }
 
 void * SkAPngReader::CreateAPngHeaderData(size_t data_size)
@@ -213,3 +337,247 @@ void SkAPngReader::DestroyAPngHeaderData(void * pData)
 {
 	free(pData);
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// frame index sidecar
+///////////////////////////////////////////////////////////////////////////////
+
+// A header, one record per frame, then the fdAT blocks of every frame in order. Fields are
+// in native byte order: the blob is a local cache, not an interchange format.
+static const uint32_t kFrameIndexMagic = SkSetFourByteTag('A', 'P', 'N', 'I');
+static const uint32_t kFrameIndexVersion = 3;
+
+struct SkAPngFrameIndexHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t streamLength;
+	uint64_t contentHash;
+	uint32_t headerHash;
+	uint32_t frameCount;
+	uint32_t playCount;
+	uint32_t tableFrames;
+	uint64_t blockCount;
+};
+
+struct SkAPngFrameIndexRecord {
+	uint64_t fcTLPosition;
+	uint32_t fcTLHash;
+	int32_t left;
+	int32_t top;
+	int32_t width;
+	int32_t height;
+	int32_t duration;
+	uint32_t blockCount;
+	uint8_t disposal;
+	uint8_t blend;
+	uint8_t complete;
+	uint8_t reserved;
+};
+
+struct SkAPngFrameIndexBlock {
+	uint64_t position;
+	uint64_t size;
+};
+
+static uint32_t frame_index_header_hash(const void* headerData, size_t headerLen)
+{
+	return SkOpts::hash(headerData, headerLen, kFrameIndexVersion);
+}
+
+// reads size bytes at position, leaving the stream position (which the main codec uses)
+// where it was.
+static bool read_at(SkStream* stream, size_t position, void* buffer, size_t size)
+{
+	const uint8_t* memoryBase = static_cast<const uint8_t*>(stream->getMemoryBase());
+	if (memoryBase)
+	{
+		if (position > stream->getLength() || size > stream->getLength() - position)
+			return false;
+		memcpy(buffer, memoryBase + position, size);
+		return true;
+	}
+	const size_t savedPosition = stream->getPosition();
+	const bool read = stream->seek(position) && stream->read(buffer, size) == size;
+	stream->seek(savedPosition);
+	return read;
+}
+
+// whether frame's fcTL is still where it was found, with the same contents.
+static bool fcTL_matches(SkStream* stream, const SkAPngFrameContext* frame)
+{
+	png_byte fcTL[8 + 26];
+	return read_at(stream, frame->m_fcTLPosition - 8, fcTL, sizeof(fcTL))
+		&& png_get_uint_32(fcTL) == 26 && !memcmp(fcTL + 4, "fcTL", 4)
+		&& SkOpts::hash(fcTL + 8, 26) == frame->m_fcTLHash;
+}
+
+sk_sp<SkData> SkAPngReader::serializeFrameTable(size_t streamLength, uint64_t contentHash) const
+{
+	if (!m_bParseComplete || m_frames.empty() || !m_apngHeaderData || !streamLength)
+		return nullptr;
+
+	SkAPngFrameIndexHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = kFrameIndexMagic;
+	header.version = kFrameIndexVersion;
+	header.streamLength = streamLength;
+	header.contentHash = contentHash;
+	header.headerHash = frame_index_header_hash(m_apngHeaderData, m_apngHeaderDataLen);
+	header.frameCount = m_frameCount;
+	header.playCount = m_playCount;
+	header.tableFrames = static_cast<uint32_t>(m_frames.size());
+	for (const auto& frame : m_frames)
+		header.blockCount += frame->m_fadtBlocks.size();
+
+	const size_t size = sizeof(header) + m_frames.size() * sizeof(SkAPngFrameIndexRecord)
+		+ header.blockCount * sizeof(SkAPngFrameIndexBlock);
+	sk_sp<SkData> data = SkData::MakeUninitialized(size);
+	uint8_t* out = static_cast<uint8_t*>(data->writable_data());
+	memcpy(out, &header, sizeof(header));
+	out += sizeof(header);
+
+	for (const auto& frame : m_frames)
+	{
+		SkAPngFrameIndexRecord record;
+		memset(&record, 0, sizeof(record));
+		record.fcTLPosition = frame->m_fcTLPosition;
+		record.fcTLHash = frame->m_fcTLHash;
+		const SkIRect rect = frame->frameRect();
+		record.left = rect.fLeft;
+		record.top = rect.fTop;
+		record.width = rect.width();
+		record.height = rect.height();
+		record.duration = frame->getDuration();
+		record.blockCount = static_cast<uint32_t>(frame->m_fadtBlocks.size());
+		record.disposal = static_cast<uint8_t>(frame->getDisposalMethod());
+		record.blend = SkCodecAnimation::Blend::kPriorFrame == frame->getBlend() ? 1 : 0;
+		record.complete = frame->isComplete() ? 1 : 0;
+		memcpy(out, &record, sizeof(record));
+		out += sizeof(record);
+	}
+
+	for (const auto& frame : m_frames)
+	{
+		for (const SkAPngFrameBlock& block : frame->m_fadtBlocks)
+		{
+			const SkAPngFrameIndexBlock indexBlock = { block.blockPosition, block.blockSize };
+			memcpy(out, &indexBlock, sizeof(indexBlock));
+			out += sizeof(indexBlock);
+		}
+	}
+	SkASSERT(out == data->bytes() + size);
+	return data;
+}
+
+bool SkAPngReader::loadFrameTable(const void* data, size_t length, SkStream* stream, uint64_t contentHash)
+{
+	SkAPngFrameIndexHeader header;
+	if (!data || length < sizeof(header) || !m_apngHeaderData || !stream->hasLength())
+		return false;
+	memcpy(&header, data, sizeof(header));
+
+	// acTL was read by the open, so it must agree as well.
+	const size_t streamLength = stream->getLength();
+	if (header.magic != kFrameIndexMagic || header.version != kFrameIndexVersion
+		|| header.streamLength != streamLength
+		|| header.contentHash != contentHash
+		|| header.headerHash != frame_index_header_hash(m_apngHeaderData, m_apngHeaderDataLen)
+		|| header.frameCount != static_cast<uint32_t>(m_frameCount)
+		|| header.playCount != static_cast<uint32_t>(m_playCount)
+		|| !header.tableFrames || header.tableFrames > header.frameCount
+		|| header.blockCount > streamLength)
+		return false;
+	const uint64_t expectedLength = sizeof(header)
+		+ static_cast<uint64_t>(header.tableFrames) * sizeof(SkAPngFrameIndexRecord)
+		+ header.blockCount * sizeof(SkAPngFrameIndexBlock);
+	if (expectedLength != length)
+		return false;
+
+	const uint8_t* records = static_cast<const uint8_t*>(data) + sizeof(header);
+	const uint8_t* blocks = records + header.tableFrames * sizeof(SkAPngFrameIndexRecord);
+	uint64_t blockIndex = 0;
+	std::vector<std::unique_ptr<SkAPngFrameContext>> frames;
+	frames.reserve(header.tableFrames);
+	for (uint32_t i = 0; i < header.tableFrames; i++)
+	{
+		SkAPngFrameIndexRecord record;
+		memcpy(&record, records + i * sizeof(record), sizeof(record));
+		const uint8_t kKeep = static_cast<uint8_t>(SkCodecAnimation::DisposalMethod::kKeep);
+		const uint8_t kRestorePrevious = static_cast<uint8_t>(SkCodecAnimation::DisposalMethod::kRestorePrevious);
+		if (record.left < 0 || record.top < 0 || record.width <= 0 || record.height <= 0
+			|| record.duration < 0 || record.disposal < kKeep || record.disposal > kRestorePrevious
+			|| record.blend > 1 || record.blockCount > header.blockCount - blockIndex
+			|| record.fcTLPosition < 8 || record.fcTLPosition > streamLength)
+			return false;
+
+		std::unique_ptr<SkAPngFrameContext> frame(new SkAPngFrameContext(this, static_cast<int>(i)));
+		frame->setXYWH(record.left, record.top, record.width, record.height);
+		frame->setDuration(record.duration);
+		frame->setDisposalMethod(static_cast<SkCodecAnimation::DisposalMethod>(record.disposal));
+		frame->setBlend(record.blend ? SkCodecAnimation::Blend::kPriorFrame : SkCodecAnimation::Blend::kBG);
+		frame->m_fcTLPosition = static_cast<size_t>(record.fcTLPosition);
+		frame->m_fcTLHash = record.fcTLHash;
+		// checked by verifyFrame() when the frame is first decoded.
+		frame->m_fcTLVerified = false;
+		for (uint32_t b = 0; b < record.blockCount; b++, blockIndex++)
+		{
+			SkAPngFrameIndexBlock block;
+			memcpy(&block, blocks + blockIndex * sizeof(block), sizeof(block));
+			if (block.position > streamLength || block.size > streamLength - block.position)
+				return false;
+			frame->addAPngFrameBlock(static_cast<size_t>(block.position), static_cast<size_t>(block.size));
+		}
+		if (record.complete)
+			frame->setComplete();
+		frames.push_back(std::move(frame));
+	}
+
+	// spot checks, so that a stale blob fails here rather than on some later frame. Frame 0's
+	// fcTL came before IDAT, so the open has usually parsed it already.
+	SkAPngFrameContext* first = frames.front().get();
+	if (!m_frames.empty() && m_frames.front()->m_fcTLPosition == first->m_fcTLPosition)
+	{
+		if (m_frames.front()->m_fcTLHash != first->m_fcTLHash)
+			return false;
+		first->m_fcTLVerified = true;
+	}
+	// the first fdAT block must start the data of an fdAT chunk of its size, after the
+	// sequence number.
+	for (const auto& frame : frames)
+	{
+		if (frame->m_fadtBlocks.empty())
+			continue;
+		const SkAPngFrameBlock& block = frame->m_fadtBlocks.front();
+		png_byte fdAT[12];
+		if (block.blockPosition < sizeof(fdAT)
+			|| !read_at(stream, block.blockPosition - sizeof(fdAT), fdAT, sizeof(fdAT))
+			|| memcmp(fdAT + 4, "fdAT", 4) || png_get_uint_32(fdAT) != block.blockSize + 4
+			|| !fcTL_matches(stream, frame.get()))
+			return false;
+		frame->m_fcTLVerified = true;
+		break;
+	}
+	if (!first->m_fcTLVerified && !fcTL_matches(stream, first))
+		return false;
+	first->m_fcTLVerified = true;
+
+	m_frames.swap(frames);
+	// required frames and alpha depend on the frames before, which are now in place.
+	for (auto& frame : m_frames)
+		setAlphaAndRequiredFrame(frame.get());
+	m_totalFrames = static_cast<int>(m_frames.size());
+	m_sequenceNumber = 0;
+	m_nextChunkPos = streamLength;
+	m_bParseComplete = true;
+	return true;
+}
+
+bool SkAPngReader::verifyFrame(SkStream* stream, int index)
+{
+	if (index < 0 || index >= static_cast<int>(m_frames.size()))
+		return false;
+	SkAPngFrameContext* frame = m_frames[index].get();
+	if (!frame->m_fcTLVerified)
+		frame->m_fcTLVerified = fcTL_matches(stream, frame);
+	return frame->m_fcTLVerified;
+}
@@ -8,6 +8,7 @@
 #define SkAPngReader_DEFINED
 
 #include "SkAPngCodec.h"
+#include "SkData.h"
 #include "SkFrameHolder.h"
 #include "png.h"
 
@@ -40,10 +41,7 @@ public:
 	}
 
 protected:
-	bool onReportsAlpha() const override
-	{
-		return false;
-	}
+	bool onReportsAlpha() const override;
 
 private:
 
@@ -51,6 +49,11 @@ private:
 
 	// apng frame blocks for this frame.
 	std::vector<SkAPngFrameBlock> m_fadtBlocks;
+	// stream offset and hash of this frame's fcTL data, which a frame index blob is checked against.
+	size_t m_fcTLPosition;
+	uint32_t m_fcTLHash;
+	// false for frames of a loaded frame index until their fcTL has been read back.
+	bool m_fcTLVerified;
 
 	bool m_isComplete;
 
@@ -81,6 +84,17 @@ public:
 
 	void fallbackNotAnimated();
 
+	// whether frames may have transparent pixels (alpha color type or tRNS); this decides
+	// which frames can be decoded without their prior frame.
+	bool hasAlpha() const
+	{
+		return m_bHasAlpha;
+	}
+	void setHasAlpha(bool bHasAlpha)
+	{
+		m_bHasAlpha = bHasAlpha;
+	}
+
 	bool needParseFrameInfo()
 	{
 		return m_bNeedParseFrameInfo;
@@ -92,20 +106,65 @@ public:
 
 	const SkAPngFrameContext* frameContext(int index) const;
 
-	// parse apng's all frame info, don't parse frame's data
-	bool parseFrameInfos(SkStream* stream, int length, const char * tag);
+	// parse one apng chunk's frame info, don't parse frame's data. data holds the first
+	// min(length, kMaxFrameInfoBytes) bytes of the chunk data, which starts at dataPosition
+	// in the stream; fdAT blocks are recorded by that absolute offset.
+	static constexpr size_t kMaxFrameInfoBytes = 26;
+	bool parseFrameInfos(const png_byte* data, size_t dataPosition, int length, const char * tag);
+
+	// frame table is filled on demand : scans chunk headers, from where the previous scan
+	// stopped, until frame untilFrame is fully known or the available data ends. -1 scans
+	// all available data. Chunk data other than fcTL and the fdAT sequence is skipped.
+	// A non-zero availableEnd stops the scan at the first chunk reaching past it, without
+	// reading there, to be retried later.
+	void parseFrames(SkStream* stream, int untilFrame, size_t availableEnd = 0);
+	void setNextChunkPosition(size_t pos)
+	{
+		m_nextChunkPos = pos;
+	}
+	// frames whose fcTL has been seen so far
+	int knownFrameCount() const
+	{
+		return static_cast<int>(m_frames.size());
+	}
+	// whether parseFrames() has reached IEND (or bad data), so the frame table is final.
+	bool isParseComplete() const
+	{
+		return m_bParseComplete;
+	}
 
-	// frame png IHDR header
-	void setIHDR_w_h(int width, int height);
+	// frame index sidecar : the final frame table (rects, durations, disposal, blend and
+	// fdAT blocks) as a versioned blob, or nullptr before parseFrames() is complete.
+	// contentHash is the caller's hash of the whole file, stored in the blob to be checked
+	// on load along with the stream length and the compact header.
+	sk_sp<SkData> serializeFrameTable(size_t streamLength, uint64_t contentHash) const;
+	// replaces the frame table with a serializeFrameTable() blob and ends parsing. Only
+	// frame 0 and the first frame with fdAT data are read back from stream : their fcTL must
+	// hash as it did when the blob was built, and that fdAT block must start an fdAT chunk of
+	// its size. Returns false, keeping the current table, if the blob is malformed, of another
+	// version, or does not match this file.
+	bool loadFrameTable(const void* data, size_t length, SkStream* stream, uint64_t contentHash);
+	// reads back the fcTL of a frame installed by loadFrameTable() the first time it is
+	// asked for; parsed frames are always verified. Returns false if it does not match.
+	bool verifyFrame(SkStream* stream, int index);
+
+	// frame png header : takes ownership of the file header (signature up to the
+	// first IDAT) and keeps only the chunks a frame decoder needs, i.e. IHDR, PLTE
+	// and tRNS, so that per-frame setup does not depend on the size of the header.
 	void setAPngHeadData(void* apngHeaderData, int len, size_t pos);
-	void* getAPngHeadData()
+	const void* getAPngHeadData() const
 	{
 		return m_apngHeaderData;
 	}
-	size_t getAPngHeadDataLen()
+	size_t getAPngHeadDataLen() const
 	{
 		return m_apngHeaderDataLen;
 	}
+	// offset of the IHDR width/height inside the frame png header
+	size_t getIHDRDataPos() const
+	{
+		return m_posIDHRData;
+	}
 	
 	// frame decoder type
 	void setFrameDecoderType(int type)
@@ -129,6 +188,11 @@ public:
 	
 protected:
 	void addFrameIfNecessary();
+
+	// Parses the chunk at m_nextChunkPos from its 8 header bytes and the first bytes of its
+	// data, and moves past it. Returns false when the scan stops: at IEND, on bad data, or
+	// at a chunk ending after streamLength (0 if unknown), to be retried with more data.
+	bool parseNextChunk(const png_byte header[8], const png_byte* data, size_t streamLength);
 	const SkFrame* onGetFrame(int i) const override;
 
 protected:
@@ -143,6 +207,11 @@ protected:
 	size_t m_apngHeaderDataLen;
 
 	bool m_bNeedParseFrameInfo;
+	bool m_bHasAlpha;
+
+	// where parseFrames() continues, and whether it has reached IEND (or bad data).
+	size_t m_nextChunkPos;
+	bool m_bParseComplete;
 
 	std::vector<std::unique_ptr<SkAPngFrameContext>> m_frames;
 
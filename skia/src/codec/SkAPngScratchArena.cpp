@@ -0,0 +1,88 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "SkAPngScratchArena.h"
+
+#include "png.h"
+
+struct SkAPngScratchArenaProcs {
+	static png_voidp Malloc(png_structp png_ptr, png_alloc_size_t size) {
+		return static_cast<SkAPngScratchArena*>(png_get_mem_ptr(png_ptr))->allocBlock(size);
+	}
+
+	static void Free(png_structp png_ptr, png_voidp ptr) {
+		static_cast<SkAPngScratchArena*>(png_get_mem_ptr(png_ptr))->freeBlock(ptr);
+	}
+};
+
+SkAPngScratchArena::SkAPngScratchArena()
+	: m_heapAllocations(0)
+{
+	for (size_t& size : m_slotSizes) {
+		size = 0;
+	}
+}
+
+SkAPngScratchArena::~SkAPngScratchArena()
+{
+	for (const Block& block : m_blocks) {
+		SkASSERT(!block.fInUse);
+		sk_free(block.fPtr);
+	}
+}
+
+void* SkAPngScratchArena::get(Slot slot, size_t bytes)
+{
+	if (bytes > m_slotSizes[slot]) {
+		m_slots[slot].reset(bytes);
+		m_slotSizes[slot] = bytes;
+		m_heapAllocations++;
+	}
+	return m_slots[slot].get();
+}
+
+void* SkAPngScratchArena::createReadStruct()
+{
+	return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr,
+		this, SkAPngScratchArenaProcs::Malloc, SkAPngScratchArenaProcs::Free);
+}
+
+void* SkAPngScratchArena::allocBlock(size_t size)
+{
+	// Every png_struct asks for the same few sizes, so the smallest free block that fits is
+	// almost always an exact match.
+	Block* best = nullptr;
+	for (Block& block : m_blocks) {
+		if (!block.fInUse && block.fSize >= size && (!best || block.fSize < best->fSize)) {
+			best = &block;
+		}
+	}
+	if (best) {
+		best->fInUse = true;
+		return best->fPtr;
+	}
+
+	void* ptr = sk_malloc_flags(size, 0);
+	if (!ptr) {
+		return nullptr;
+	}
+	m_heapAllocations++;
+	m_blocks.push_back({ ptr, size, true });
+	return ptr;
+}
+
+void SkAPngScratchArena::freeBlock(void* ptr)
+{
+	for (Block& block : m_blocks) {
+		if (block.fPtr == ptr) {
+			SkASSERT(block.fInUse);
+			block.fInUse = false;
+			return;
+		}
+	}
+	SkASSERT(false);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef SkAPngScratchArena_DEFINED
+#define SkAPngScratchArena_DEFINED
+
+#include "SkTemplates.h"
+
+#include <vector>
+
+// Memory APNG frame decoders reuse from one frame to the next, so a looping animation stops
+// touching the heap once every frame has been decoded once. Buffers only grow, to the
+// largest frame they have served, and the png_structs rebuilt for each frame take their
+// memory from blocks the previous ones gave back.
+//
+// Not thread-safe: SkAPngCodec owns one for its frame decoder, and each parallel
+// run of getFramesPixels uses its own. It must outlive the png_structs it created.
+class SkAPngScratchArena : SkNoncopyable {
+public:
+	enum Slot {
+		kInterlace_Slot,	// Rows of an interlaced frame, until the last pass.
+		kBlendRow_Slot,		// A row of an APNG_BLEND_OP_OVER frame before blending.
+
+		kLast_Slot = kBlendRow_Slot,
+	};
+
+	SkAPngScratchArena();
+	~SkAPngScratchArena();
+
+	// Buffer for slot, at least bytes long. Its contents are lost when it has to grow.
+	void* get(Slot slot, size_t bytes);
+
+	// png_create_read_struct, with libpng's (and zlib's) memory taken from this arena.
+	// Returns a png_structp, or nullptr.
+	void* createReadStruct();
+
+	// Times memory was taken from the heap, for checking that decoding has settled.
+	int heapAllocations() const { return m_heapAllocations; }
+
+	// Counts an allocation a frame decoder made itself (the decoder, its frame header, a
+	// swizzler for a new row setup, the color table, a wide xform or xform storage), so
+	// heapAllocations() covers all of them.
+	void countHeapAllocation() { m_heapAllocations++; }
+
+private:
+	struct Block {
+		void*	fPtr;
+		size_t	fSize;
+		bool	fInUse;
+	};
+
+	// libpng memory callbacks; the arena is the png_struct's mem_ptr.
+	void* allocBlock(size_t size);
+	void freeBlock(void* ptr);
+
+	SkAutoTMalloc<uint8_t> m_slots[kLast_Slot + 1];
+	size_t m_slotSizes[kLast_Slot + 1];
+	std::vector<Block> m_blocks;
+	int m_heapAllocations;
+
+	friend struct SkAPngScratchArenaProcs;
+};
+
+#endif  // SkAPngScratchArena_DEFINED
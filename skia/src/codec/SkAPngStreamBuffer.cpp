@@ -0,0 +1,163 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "SkAPngStreamBuffer.h"
+
+#include <algorithm>
+
+// Source reads are at least this large, so chunk headers do not each cost a read.
+static constexpr size_t kMinSourceRead = 4096;
+
+constexpr size_t SkAPngStreamBuffer::kBlockSize;
+
+SkAPngStreamBuffer::SkAPngStreamBuffer(std::unique_ptr<SkStream> source)
+	: m_source(std::move(source))
+	, m_windowStart(0)
+	, m_sourceEnd(0)
+	, m_discardedBefore(0)
+	, m_position(0)
+	, m_buffering(true)
+{
+}
+
+SkAPngStreamBuffer::~SkAPngStreamBuffer()
+{
+}
+
+bool SkAPngStreamBuffer::IsSeekable(SkStream* stream)
+{
+	return stream->getMemoryBase() || (stream->hasPosition() && stream->seek(stream->getPosition()));
+}
+
+void SkAPngStreamBuffer::discardBefore(size_t position)
+{
+	position = std::min(position, m_sourceEnd);
+	if (position <= m_discardedBefore) {
+		return;
+	}
+	m_discardedBefore = position;
+	// Free every block wholly before position, including a partly filled last one.
+	while (!m_blocks.empty() && std::min(m_windowStart + kBlockSize, m_sourceEnd) <= position) {
+		m_blocks.pop_front();
+		m_windowStart = m_blocks.empty() ? m_sourceEnd : m_windowStart + kBlockSize;
+	}
+}
+
+void SkAPngStreamBuffer::stopBuffering()
+{
+	m_buffering = false;
+}
+
+void SkAPngStreamBuffer::fill(size_t end)
+{
+	while (m_sourceEnd < end) {
+		size_t used = (m_sourceEnd - m_windowStart) % kBlockSize;
+		if (m_blocks.empty() || (!used && m_sourceEnd > m_windowStart)) {
+			m_blocks.emplace_back(new uint8_t[kBlockSize]);
+			used = 0;
+		}
+		const size_t wanted = std::min(kBlockSize - used, std::max(end - m_sourceEnd, kMinSourceRead));
+		const size_t bytesRead = m_source->read(m_blocks.back().get() + used, wanted);
+		m_sourceEnd += bytesRead;
+		if (!bytesRead) {
+			// No more data yet; a later call may get some.
+			return;
+		}
+	}
+}
+
+void SkAPngStreamBuffer::copyOut(size_t position, void* buffer, size_t size) const
+{
+	uint8_t* dst = static_cast<uint8_t*>(buffer);
+	size_t offset = position - m_windowStart;
+	while (size) {
+		const size_t inBlock = std::min(size, kBlockSize - offset % kBlockSize);
+		memcpy(dst, m_blocks[offset / kBlockSize].get() + offset % kBlockSize, inBlock);
+		dst += inBlock;
+		offset += inBlock;
+		size -= inBlock;
+	}
+}
+
+size_t SkAPngStreamBuffer::read(void* buffer, size_t size)
+{
+	if (m_position < m_discardedBefore) {
+		// Left behind by discardBefore().
+		return 0;
+	}
+
+	// While buffering, skipped bytes are read and kept too: frame data is skipped when
+	// frames are scanned and read when they are decoded.
+	if (m_buffering) {
+		this->fill(m_position + size);
+	}
+	size_t bytesRead = std::min(size, m_sourceEnd - m_position);
+	if (buffer) {
+		this->copyOut(m_position, buffer, bytesRead);
+	}
+	m_position += bytesRead;
+
+	if (!m_buffering) {
+		if (bytesRead < size) {
+			const size_t direct = m_source->read(buffer ? static_cast<uint8_t*>(buffer) + bytesRead : nullptr,
+				size - bytesRead);
+			m_sourceEnd += direct;
+			m_position += direct;
+			bytesRead += direct;
+		}
+		this->discardBefore(m_position);
+	}
+	return bytesRead;
+}
+
+size_t SkAPngStreamBuffer::peek(void* buffer, size_t size) const
+{
+	// Peeking never reads from the source, so it only sees data that has already arrived.
+	if (m_position < m_discardedBefore) {
+		return 0;
+	}
+	size = std::min(size, m_sourceEnd - m_position);
+	this->copyOut(m_position, buffer, size);
+	return size;
+}
+
+bool SkAPngStreamBuffer::isAtEnd() const
+{
+	return m_position >= m_sourceEnd && m_source->isAtEnd();
+}
+
+bool SkAPngStreamBuffer::rewind()
+{
+	return this->seek(0);
+}
+
+bool SkAPngStreamBuffer::seek(size_t position)
+{
+	if (position < m_discardedBefore) {
+		return false;
+	}
+	if (position > m_sourceEnd) {
+		// Seeking ahead reads up to there. Like other streams, stop at the end of the data.
+		if (!m_buffering) {
+			m_position = m_sourceEnd;
+			this->read(nullptr, position - m_position);
+			return true;
+		}
+		this->fill(position);
+		position = std::min(position, m_sourceEnd);
+	}
+	m_position = position;
+	return true;
+}
+
+bool SkAPngStreamBuffer::move(long offset)
+{
+	if (offset < 0 && static_cast<size_t>(-offset) > m_position) {
+		return false;
+	}
+	return this->seek(m_position + offset);
+}
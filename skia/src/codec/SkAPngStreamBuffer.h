@@ -0,0 +1,80 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef SkAPngStreamBuffer_DEFINED
+#define SkAPngStreamBuffer_DEFINED
+
+#include "SkStream.h"
+
+#include <deque>
+#include <memory>
+
+// Makes a forward-only stream (e.g. a download in progress) look seekable to the png codecs.
+//
+// Data read from the source is kept, in fixed-size blocks, until discardBefore() lets go of
+// a prefix; whole blocks are then freed. SkAPngCodec does that as frames are decoded, since
+// frame decoders only need the compact header SkAPngReader keeps. What is held is the data
+// from the oldest frame not yet decoded up to the furthest point read. getFrameCount() and
+// getFrameInfo() only scan what bufferedEnd() covers, so asking about frames never pulls
+// more of the file. Seeking into a discarded range fails.
+//
+// Streams that turn out not to be APNGs call stopBuffering() after the probe, and are then
+// read straight through, as the png codec reads them without this buffer.
+class SkAPngStreamBuffer : public SkStream {
+public:
+	explicit SkAPngStreamBuffer(std::unique_ptr<SkStream> source);
+	~SkAPngStreamBuffer() override;
+
+	// Whether stream can seek by itself, so it needs no buffer. Checked with a seek to the
+	// current position, which moves nothing.
+	static bool IsSeekable(SkStream* stream);
+
+	// Drops the data before position. Seeking there fails from now on.
+	void discardBefore(size_t position);
+
+	// From now on, data is dropped once read, and reads past what is buffered go straight
+	// to the source. Rewinding is possible only until the first read after this.
+	void stopBuffering();
+
+	// Start of the data that can still be read.
+	size_t retainedFrom() const { return m_discardedBefore; }
+	// End of the data read from the source so far.
+	size_t bufferedEnd() const { return m_sourceEnd; }
+
+	size_t read(void* buffer, size_t size) override;
+	size_t peek(void* buffer, size_t size) const override;
+	bool isAtEnd() const override;
+
+	bool rewind() override;
+	bool hasPosition() const override { return true; }
+	size_t getPosition() const override { return m_position; }
+	bool seek(size_t position) override;
+	bool move(long offset) override;
+
+	bool hasLength() const override { return m_source->hasLength(); }
+	size_t getLength() const override { return m_source->getLength(); }
+
+private:
+	static constexpr size_t kBlockSize = 64 * 1024;
+
+	// Reads from the source until it has been read up to end, or it has no more data yet.
+	void fill(size_t end);
+	// Copies size buffered bytes from position.
+	void copyOut(size_t position, void* buffer, size_t size) const;
+
+	std::unique_ptr<SkStream> m_source;
+	// Bytes m_windowStart up to m_sourceEnd of the source; all but the last block are full.
+	std::deque<std::unique_ptr<uint8_t[]>> m_blocks;
+	size_t m_windowStart;
+	size_t m_sourceEnd;
+	size_t m_discardedBefore;
+	size_t m_position;
+	bool m_buffering;
+
+	typedef SkStream INHERITED;
+};
+
+#endif  // SkAPngStreamBuffer_DEFINED
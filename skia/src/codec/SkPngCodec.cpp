@@ -11,20 +11,28 @@
 #include "SkColorSpace.h"
 #include "SkColorSpacePriv.h"
 #include "SkColorTable.h"
+#include "SkExecutor.h"
+#include "SkHalf.h"
 #include "SkMath.h"
+#include "SkNx.h"
 #include "SkOpts.h"
 #include "SkPngCodec.h"
 #include "SkPoint3.h"
 #include "SkSize.h"
 #include "SkStream.h"
 #include "SkSwizzler.h"
+#include "SkTaskGroup.h"
 #include "SkTemplates.h"
 #include "SkUtils.h"
 
 #include "png.h"
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "SkAPngCodec.h"
+#include "SkAPngStreamBuffer.h"
 
 // This warning triggers false postives way too often in here.
 #if defined(__GNUC__) && !defined(__clang__)
@@ -130,8 +138,20 @@ static inline bool is_chunk(const png_byte* chunk, const char* tag) {
     return memcmp(chunk + 4, tag, 4) == 0;
 }
 
+// Feeds the next length bytes of stream to libpng. Memory-backed streams (SkMemoryStream,
+// SkData) are handed to libpng in place; others are copied through buffer.
 static inline bool process_data(png_structp png_ptr, png_infop info_ptr,
         SkStream* stream, void* buffer, size_t bufferSize, size_t length) {
+    const png_byte* memoryBase = (const png_byte*) stream->getMemoryBase();
+    if (memoryBase && stream->hasPosition() && stream->hasLength()) {
+        const size_t position = stream->getPosition();
+        const size_t available = std::min(length, stream->getLength() - position);
+        // Advance first: png_process_data may longjmp out.
+        stream->skip(available);
+        png_process_data(png_ptr, info_ptr, (png_bytep) memoryBase + position, available);
+        return available == length;
+    }
+
     while (length > 0) {
         const size_t bytesToProcess = std::min(bufferSize, length);
         const size_t bytesRead = stream->read(buffer, bytesToProcess);
@@ -222,12 +242,19 @@ void SkPngCodec::processData() {
             }
 
             png_byte* chunk = reinterpret_cast<png_byte*>(buffer);
+            length = png_get_uint_32(chunk);
+            if (is_chunk(chunk, "fcTL") || is_chunk(chunk, "fdAT")) {
+                // APNG frame chunks are read by SkAPngCodec from its own index. Handing them
+                // to libpng would only have it buffer each one as an unknown chunk.
+                if (this->stream()->skip(length + 4) < length + 4) {
+                    break;
+                }
+                continue;
+            }
             png_process_data(fPng_ptr, fInfo_ptr, chunk, 8);
             if (is_chunk(chunk, "IEND")) {
                 iend = true;
             }
-
-            length = png_get_uint_32(chunk);
         } else {
             length = fIdatLength;
             png_byte idat[] = {0, 0, 0, 0, 'I', 'D', 'A', 'T'};
@@ -434,6 +461,8 @@ sk_sp<SkColorSpace> read_color_space(png_structp png_ptr, png_infop info_ptr,
 void SkPngCodec::allocateStorage(const SkImageInfo& dstInfo) {
     switch (fXformMode) {
         case kSwizzleOnly_XformMode:
+        case kIndexOnly_XformMode:
+        case kWideF16_XformMode:
             break;
         case kColorOnly_XformMode:
             // Intentional fall through.  A swizzler hasn't been created yet, but one will
@@ -466,21 +495,234 @@ static SkColorSpaceXform::ColorFormat png_select_xform_format(const SkEncodedInf
     return SkColorSpaceXform::kRGBA_8888_ColorFormat;
 }
 
-void SkPngCodec::applyXformRow(void* dst, const void* src) {
+void SkPngCodec::fusedXformRow(void* dst, const void* src) {
+    // 2K of RGBA: small enough to stay in L1 between the expand and the xform.
+    constexpr int kChunk = 512;
+    uint32_t rgba[kChunk];
+
+    const SkPMColor* colors = get_color_ptr(fColorTable.get());
+    const uint8_t* srcRow = (const uint8_t*) src;
+    uint8_t* dstRow = (uint8_t*) dst;
+    for (int x = 0; x < fXformWidth; x += kChunk) {
+        const int count = SkTMin(kChunk, fXformWidth - x);
+        switch (this->getEncodedInfo().color()) {
+            case SkEncodedInfo::kRGB_Color:
+                SkOpts::RGB_to_RGB1(rgba, srcRow + 3 * x, count);
+                break;
+            case SkEncodedInfo::kGray_Color:
+                SkOpts::gray_to_RGB1(rgba, srcRow + x, count);
+                break;
+            case SkEncodedInfo::kGrayAlpha_Color:
+                SkOpts::grayA_to_RGBA(rgba, srcRow + 2 * x, count);
+                break;
+            case SkEncodedInfo::kPalette_Color:
+                // The table holds unpremul RGBA when the xform runs on decode.
+                for (int i = 0; i < count; i++) {
+                    rgba[i] = colors[srcRow[x + i]];
+                }
+                break;
+            default:
+                SkASSERT(false);
+                return;
+        }
+        this->applyColorXform(dstRow + fFusedXformBpp * x, rgba, count);
+    }
+}
+
+// Looks each palette index up in colors, a 1 KB table that stays in L1.
+static void expand_palette_row(uint32_t* dst, const uint8_t* src, const SkPMColor* colors,
+                               int count) {
+    for (int x = 0; x < count; x++) {
+        dst[x] = colors[src[x]];
+    }
+}
+
+// Converts big-endian 16-bit RGB (alpha 1) or RGBA pixels to F16, a pixel per vector.
+static void u16be_to_f16_row(uint64_t* dst, const uint8_t* src, int count, bool hasAlpha,
+                             bool premul) {
+    const Sk4f scale(1.0f / 65535.0f);
+    for (int x = 0; x < count; x++) {
+        Sk4h be;
+        if (hasAlpha) {
+            be = Sk4h::Load(src);
+            src += 8;
+        } else {
+            uint16_t rgb[4];
+            memcpy(rgb, src, 6);
+            rgb[3] = 0xFFFF;
+            be = Sk4h::Load(rgb);
+            src += 6;
+        }
+        Sk4f px = SkNx_cast<float>((be << 8) | (be >> 8)) * scale;
+        if (premul) {
+            px = px * Sk4f(px[3], px[3], px[3], 1.0f);
+        }
+        SkFloatToHalf_finite_ftz(px).store(&dst[x]);
+    }
+}
+
+void SkPngCodec::applyXformRow(void* dst, const void* src, void* xformSrcRow) {
     switch (fXformMode) {
         case kSwizzleOnly_XformMode:
+            if (fExpandPalette && fSwizzler->swizzleWidth() == fRowWidth) {
+                expand_palette_row((uint32_t*) dst, (const uint8_t*) src,
+                                   get_color_ptr(fColorTable.get()), fSwizzler->swizzleWidth());
+                break;
+            }
             fSwizzler->swizzle(dst, (const uint8_t*) src);
             break;
+        case kIndexOnly_XformMode:
+            memcpy(dst, src, fXformWidth);
+            break;
+        case kWideF16_XformMode:
+            if (fWideXform) {
+                SkAssertResult(fWideXform->apply(SkColorSpaceXform::kRGBA_F16_ColorFormat, dst,
+                                                 fWideSrcFormat, src, fXformWidth,
+                                                 fWideAlphaType));
+            } else {
+                u16be_to_f16_row((uint64_t*) dst, (const uint8_t*) src, fXformWidth,
+                                 SkColorSpaceXform::kRGBA_U16_BE_ColorFormat == fWideSrcFormat,
+                                 kPremul_SkAlphaType == fWideAlphaType);
+            }
+            break;
         case kColorOnly_XformMode:
             this->applyColorXform(dst, src, fXformWidth);
             break;
         case kSwizzleColor_XformMode:
-            fSwizzler->swizzle(fColorXformSrcRow, (const uint8_t*) src);
-            this->applyColorXform(dst, fColorXformSrcRow, fXformWidth);
+            // A swizzler narrower than the image is sampling or taking a subset.
+            if (fFusedXformBpp && fSwizzler->swizzleWidth() == fRowWidth) {
+                this->fusedXformRow(dst, src);
+                break;
+            }
+            fSwizzler->swizzle(xformSrcRow, (const uint8_t*) src);
+            this->applyColorXform(dst, xformSrcRow, fXformWidth);
             break;
     }
 }
 
+// Hands rows from libpng's row callback to conversion workers through a ring of row
+// buffers. Each slot records the row it holds (fReady) and the last row converted out of
+// it (fDone), so the decoding thread and the workers pass slots back and forth without
+// locks. Whenever the ring is full the decoding thread converts rows itself, so it never
+// waits on workers the executor has not started.
+class SkPngRowPipeline : SkNoncopyable {
+public:
+    SkPngRowPipeline(SkPngCodec* codec, void* dst, size_t rowBytes, size_t srcRowBytes,
+                     int height, int workers)
+        : fCodec(codec)
+        , fDst(dst)
+        , fRowBytes(rowBytes)
+        , fSrcRowBytes(srcRowBytes)
+        , fHeight(height)
+        , fWorkers(workers)
+        , fXformRowBytes(codec->dstInfo().width() * sizeof(uint64_t))
+        , fRing(kRingRows * srcRowBytes)
+        , fXformRows((workers + 1) * fXformRowBytes)
+        , fSlots(kRingRows)
+        , fNextRow(0)
+        , fProduced(0)
+        , fFinished(false)
+    {
+        for (int i = 0; i < kRingRows; i++) {
+            fSlots[i].fReady.store(-1, std::memory_order_relaxed);
+            fSlots[i].fDone.store(i - kRingRows, std::memory_order_relaxed);
+        }
+    }
+
+    static constexpr int kRingRows = 32;
+
+    void start(SkTaskGroup* group) {
+        group->batch(fWorkers, [this](int worker) { this->work(worker); });
+    }
+
+    // Called by the decoding thread for each row, in order.
+    void push(const void* row) {
+        const int rowNum = fProduced.load(std::memory_order_relaxed);
+        Slot& slot = fSlots[rowNum % kRingRows];
+        while (slot.fDone.load(std::memory_order_acquire) != rowNum - kRingRows) {
+            if (!this->convertPending()) {
+                std::this_thread::yield();
+            }
+        }
+        memcpy(this->slotRow(rowNum), row, fSrcRowBytes);
+        slot.fReady.store(rowNum, std::memory_order_release);
+        fProduced.store(rowNum + 1, std::memory_order_release);
+    }
+
+    // Called by the decoding thread once libpng is done. Returns the number of rows pushed,
+    // all of which have been converted when group->wait() returns.
+    int finish(SkTaskGroup* group) {
+        fFinished.store(true, std::memory_order_release);
+        while (this->convertPending()) {}
+        group->wait();
+        return fProduced.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<int> fReady;
+        std::atomic<int> fDone;
+    };
+
+    void* slotRow(int rowNum) {
+        return fRing.get() + (rowNum % kRingRows) * fSrcRowBytes;
+    }
+
+    void convert(int rowNum, int converter) {
+        fCodec->applyXformRow(SkTAddOffset<void>(fDst, rowNum * fRowBytes), this->slotRow(rowNum),
+                              fXformRows.get() + converter * fXformRowBytes);
+        fSlots[rowNum % kRingRows].fDone.store(rowNum, std::memory_order_release);
+    }
+
+    // Decoding thread: converts one row that has been pushed but not claimed, if any.
+    bool convertPending() {
+        const int produced = fProduced.load(std::memory_order_relaxed);
+        int rowNum = fNextRow.load(std::memory_order_relaxed);
+        while (rowNum < produced) {
+            if (fNextRow.compare_exchange_weak(rowNum, rowNum + 1)) {
+                this->convert(rowNum, fWorkers);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int worker) {
+        while (true) {
+            const int rowNum = fNextRow.fetch_add(1);
+            if (rowNum >= fHeight) {
+                return;
+            }
+            const Slot& slot = fSlots[rowNum % kRingRows];
+            while (slot.fReady.load(std::memory_order_acquire) != rowNum) {
+                if (fFinished.load(std::memory_order_acquire) &&
+                        rowNum >= fProduced.load(std::memory_order_acquire)) {
+                    // libpng stopped early; this row will never come.
+                    return;
+                }
+                std::this_thread::yield();
+            }
+            this->convert(rowNum, worker);
+        }
+    }
+
+    SkPngCodec*             fCodec;
+    void*                   fDst;
+    const size_t            fRowBytes;
+    const size_t            fSrcRowBytes;
+    const int               fHeight;
+    const int               fWorkers;
+    // Big enough for a swizzled row of any format SkPngCodec transforms from.
+    const size_t            fXformRowBytes;
+    SkAutoTMalloc<uint8_t>  fRing;
+    // One swizzle buffer per worker, and one for the decoding thread.
+    SkAutoTMalloc<uint8_t>  fXformRows;
+    std::vector<Slot>       fSlots;
+    std::atomic<int>        fNextRow;
+    std::atomic<int>        fProduced;
+    std::atomic<bool>       fFinished;
+};
+
 class SkPngNormalDecoder : public SkPngCodec {
 public:
     SkPngNormalDecoder(const SkEncodedInfo& info, const SkImageInfo& imageInfo,
@@ -490,6 +732,7 @@ public:
         , fRowsWrittenToOutput(0)
         , fDst(nullptr)
         , fRowBytes(0)
+        , fPipeline(nullptr)
         , fFirstRow(0)
         , fLastRow(0)
     {}
@@ -502,10 +745,15 @@ public:
         GetDecoder(png_ptr)->rowCallback(row, rowNum);
     }
 
+    static void PipelinedRowsCallback(png_structp png_ptr, png_bytep row, png_uint_32, int) {
+        GetDecoder(png_ptr)->fPipeline->push(row);
+    }
+
 private:
     int                         fRowsWrittenToOutput;
     void*                       fDst;
     size_t                      fRowBytes;
+    SkPngRowPipeline*           fPipeline;
 
     // Variables for partial decode
     int                         fFirstRow;  // FIXME: Move to baseclass?
@@ -520,7 +768,6 @@ private:
 
     Result decodeAllRows(void* dst, size_t rowBytes, int* rowsDecoded) override {
         const int height = this->getInfo().height();
-        png_set_progressive_read_fn(this->png_ptr(), this, nullptr, AllRowsCallback, nullptr);
         fDst = dst;
         fRowBytes = rowBytes;
 
@@ -528,7 +775,27 @@ private:
         fFirstRow = 0;
         fLastRow = height - 1;
 
-        this->processData();
+        // Swizzling (or copying indices) alone is cheaper than handing the row to another
+        // thread.
+        if (fRowWorkers > 0 && kSwizzleOnly_XformMode != fXformMode &&
+                kIndexOnly_XformMode != fXformMode &&
+                height > 2 * SkPngRowPipeline::kRingRows) {
+            png_set_progressive_read_fn(this->png_ptr(), this, nullptr, PipelinedRowsCallback,
+                                        nullptr);
+            SkPngRowPipeline pipeline(this, dst, rowBytes,
+                                      png_get_rowbytes(this->png_ptr(), this->info_ptr()),
+                                      height, fRowWorkers);
+            SkTaskGroup group(*fRowExecutor);
+            fPipeline = &pipeline;
+            pipeline.start(&group);
+            this->processData();
+            fRowsWrittenToOutput = pipeline.finish(&group);
+            fPipeline = nullptr;
+        } else {
+            png_set_progressive_read_fn(this->png_ptr(), this, nullptr, AllRowsCallback,
+                                        nullptr);
+            this->processData();
+        }
 
         if (fRowsWrittenToOutput == height) {
             return SkCodec::kSuccess;
@@ -950,8 +1217,16 @@ SkPngCodec::SkPngCodec(const SkEncodedInfo& encodedInfo, const SkImageInfo& imag
     , fInfo_ptr(info_ptr)
     , fColorXformSrcRow(nullptr)
     , fBitDepth(bitDepth)
+    , fRowWidth(imageInfo.width())
+    , fFusedXformBpp(0)
+    , fExpandPalette(false)
+    , fWideSrcFormat(SkColorSpaceXform::kRGBA_8888_ColorFormat)
+    , fWideAlphaType(kUnknown_SkAlphaType)
     , fIdatLength(0)
     , fDecodedIdat(false)
+    , fRowExecutor(nullptr)
+    , fRowWorkers(0)
+    , fFusedXformRows(true)
 {}
 
 SkPngCodec::~SkPngCodec() {
@@ -1017,21 +1292,77 @@ SkCodec::Result SkPngCodec::initializeXforms(const SkImageInfo& dstInfo, const O
 void SkPngCodec::initializeXformParams() {
     switch (fXformMode) {
         case kColorOnly_XformMode:
-            fXformWidth = this->dstInfo().width();
+            // Only used without a subset, so rows are transformed whole.
+            fXformWidth = fRowWidth;
             break;
         case kSwizzleColor_XformMode:
             fXformWidth = this->swizzler()->swizzleWidth();
             break;
+        case kIndexOnly_XformMode:
+        case kWideF16_XformMode:
+            fXformWidth = fRowWidth;
+            break;
         default:
             break;
     }
 }
 
+SkCodec::Result SkPngCodec::initializeIndexXforms() {
+    SkASSERT(SkEncodedInfo::kPalette_Color == this->getEncodedInfo().color());
+    if (setjmp(PNG_JMPBUF((png_struct*)fPng_ptr))) {
+        SkCodecPrintf("Failed on png_read_update_info.\n");
+        return kInvalidInput;
+    }
+    png_read_update_info(fPng_ptr, fInfo_ptr);
+
+    // libpng has unpacked low bit depths, so rows are one index per byte.
+    fSwizzler.reset(nullptr);
+    fXformMode = kIndexOnly_XformMode;
+    fFusedXformBpp = 0;
+    fExpandPalette = false;
+    return kSuccess;
+}
+
+SkCodec::Result SkPngCodec::initializeWideXforms(const SkImageInfo& dstInfo) {
+    SkASSERT(kRGBA_F16_SkColorType == dstInfo.colorType());
+    SkASSERT(16 == this->getEncodedInfo().bitsPerComponent());
+    if (setjmp(PNG_JMPBUF((png_struct*)fPng_ptr))) {
+        SkCodecPrintf("Failed on png_read_update_info.\n");
+        return kInvalidInput;
+    }
+    png_read_update_info(fPng_ptr, fInfo_ptr);
+
+    fWideSrcFormat = png_select_xform_format(this->getEncodedInfo());
+    if (SkColorSpaceXform::kRGBA_8888_ColorFormat == fWideSrcFormat) {
+        return kInvalidConversion;
+    }
+    fWideAlphaType = select_xform_alpha(dstInfo.alphaType(), this->getInfo().alphaType());
+    SkColorSpace* srcSpace = this->getInfo().colorSpace();
+    if (!srcSpace || !dstInfo.colorSpace() || SkColorSpace::Equals(srcSpace, dstInfo.colorSpace())) {
+        fWideXform = nullptr;
+        fWideXformDst = nullptr;
+    } else if (!fWideXform || !SkColorSpace::Equals(fWideXformDst.get(), dstInfo.colorSpace())) {
+        fWideXform = SkColorSpaceXform::New(srcSpace, dstInfo.colorSpace());
+        fWideXformDst = fWideXform ? dstInfo.refColorSpace() : nullptr;
+        if (!fWideXform) {
+            return kInvalidConversion;
+        }
+    }
+
+    fSwizzler.reset(nullptr);
+    fXformMode = kWideF16_XformMode;
+    fFusedXformBpp = 0;
+    fExpandPalette = false;
+    return kSuccess;
+}
+
 void SkPngCodec::initializeSwizzler(const SkImageInfo& dstInfo, const Options& options,
                                     bool skipFormatConversion) {
     SkImageInfo swizzlerInfo = dstInfo;
     Options swizzlerOptions = options;
     fXformMode = kSwizzleOnly_XformMode;
+    fFusedXformBpp = 0;
+    fExpandPalette = false;
     if (this->colorXform() && this->xformOnDecode()) {
         swizzlerInfo = swizzlerInfo.makeColorType(kXformSrcColorType);
         if (kPremul_SkAlphaType == dstInfo.alphaType()) {
@@ -1044,14 +1375,46 @@ void SkPngCodec::initializeSwizzler(const SkImageInfo& dstInfo, const Options& o
         // FIXME (msarett):
         // Is this a problem?
         swizzlerOptions.fZeroInitialized = kNo_ZeroInitialized;
+
+        // libpng has already unpacked low bit depths, so these rows are one byte per
+        // component and the swizzler would only expand them to RGBA.
+        switch (this->getEncodedInfo().color()) {
+            case SkEncodedInfo::kRGB_Color:
+            case SkEncodedInfo::kGray_Color:
+            case SkEncodedInfo::kGrayAlpha_Color:
+            case SkEncodedInfo::kPalette_Color:
+                if (fFusedXformRows && 16 != this->getEncodedInfo().bitsPerComponent()
+                        && !options.fSubset) {
+                    fFusedXformBpp = dstInfo.bytesPerPixel();
+                }
+                break;
+            default:
+                break;
+        }
     }
 
-    const SkPMColor* colors = get_color_ptr(fColorTable.get());
-    fSwizzler.reset(SkSwizzler::CreateSwizzler(this->getEncodedInfo(), colors, swizzlerInfo,
-                                               swizzlerOptions, nullptr, skipFormatConversion));
+    // The color table is already in the destination format (and color space), so whole
+    // rows only need a table lookup.
+    if (kSwizzleOnly_XformMode == fXformMode && !options.fSubset &&
+            SkEncodedInfo::kPalette_Color == this->getEncodedInfo().color() &&
+            (kRGBA_8888_SkColorType == dstInfo.colorType() ||
+             kBGRA_8888_SkColorType == dstInfo.colorType())) {
+        fExpandPalette = true;
+    }
+
+    fSwizzler = this->makeSwizzler(swizzlerInfo, swizzlerOptions, skipFormatConversion);
     SkASSERT(fSwizzler);
 }
 
+std::unique_ptr<SkSwizzler> SkPngCodec::makeSwizzler(const SkImageInfo& swizzlerInfo,
+                                                     const Options& options,
+                                                     bool skipFormatConversion) {
+    const SkPMColor* colors = get_color_ptr(fColorTable.get());
+    return std::unique_ptr<SkSwizzler>(SkSwizzler::CreateSwizzler(
+            this->getEncodedInfo(), colors, swizzlerInfo, options, nullptr,
+            skipFormatConversion));
+}
+
 SkSampler* SkPngCodec::getSampler(bool createIfNecessary) {
     if (fSwizzler || !createIfNecessary) {
         return fSwizzler.get();
@@ -1142,8 +1505,22 @@ std::unique_ptr<SkCodec> SkPngCodec::MakeFromStream(std::unique_ptr<SkStream> st
                                                     Result* result, SkPngChunkReader* chunkReader) {
     SkCodec* outCodec = nullptr;
 
-	if (kSuccess != SkAPngCodec::parseAPngInfos(&outCodec, stream.get(), chunkReader))
+    // Forward-only streams (e.g. downloads) are read through a buffer the APNG probe and
+    // frame decoders can seek in.
+    SkAPngStreamBuffer* streamBuffer = nullptr;
+    if (!SkAPngStreamBuffer::IsSeekable(stream.get())) {
+        streamBuffer = new SkAPngStreamBuffer(std::move(stream));
+        stream.reset(streamBuffer);
+    }
+
+	if (kSuccess != SkAPngCodec::parseAPngInfos(&outCodec, stream.get(), chunkReader, streamBuffer))
 	{
+		if (streamBuffer) {
+			// Not an APNG: replay what the probe read, then stream the rest through
+			// without keeping it, as the png codec does without the buffer.
+			streamBuffer->rewind();
+			streamBuffer->stopBuffering();
+		}
 		*result = read_header(stream.get(), chunkReader, &outCodec, nullptr, nullptr);
 		if (kSuccess == *result) {
 			// Codec has taken ownership of the stream.
@@ -16,6 +16,7 @@
 #include "SkRefCnt.h"
 #include "SkSwizzler.h"
 
+class SkExecutor;
 class SkStream;
 
 class SkPngCodec : public SkCodec {
@@ -29,6 +30,20 @@ public:
     // FIXME (scroggo): Temporarily needed by AutoCleanPng.
     void setIdatLength(size_t len) { fIdatLength = len; }
 
+    // Opt-in pipelined decoding. When set, whole-image decodes of tall non-interlaced PNGs
+    // that need a color xform inflate on the calling thread and hand each row to workers
+    // tasks on executor, which swizzle and transform rows into the destination in parallel.
+    // executor must outlive the decodes. workers == 0 turns pipelining off.
+    void setRowWorkers(SkExecutor* executor, int workers) {
+        fRowExecutor = executor;
+        fRowWorkers = executor ? workers : 0;
+    }
+
+    // When true (the default), rows that need both a format conversion and a color xform
+    // are expanded and transformed a cache-sized chunk at a time instead of in two full-row
+    // passes. Takes effect at the next decode; turned off by benchmarks comparing the two.
+    void setFusedXformRows(bool fused) { fFusedXformRows = fused; }
+
     ~SkPngCodec() override;
 
 protected:
@@ -55,7 +70,12 @@ protected:
     uint64_t onGetFillValue(const SkImageInfo&) const override;
 
     SkSampler* getSampler(bool createIfNecessary) override;
-    void applyXformRow(void* dst, const void* src);
+    void applyXformRow(void* dst, const void* src) {
+        this->applyXformRow(dst, src, fColorXformSrcRow);
+    }
+    // As above, swizzling through xformSrcRow instead of fColorXformSrcRow when a color
+    // xform follows, so rows can be converted on several threads at once.
+    void applyXformRow(void* dst, const void* src, void* xformSrcRow);
 
     voidp png_ptr() { return fPng_ptr; }
     voidp info_ptr() { return fInfo_ptr; }
@@ -99,14 +119,36 @@ protected:
 
         // Requires a swizzle and a color xform.
         kSwizzleColor_XformMode,
+
+        // Copies palette indices as they are (SkAPngCodec::getFrameIndices).
+        kIndexOnly_XformMode,
+
+        // Converts 16-bit RGB(A) rows straight to F16 (initializeWideXforms).
+        kWideF16_XformMode,
     };
 
-    bool createColorTable(const SkImageInfo& dstInfo);
+    // Builds fColorTable for dstInfo. Virtual so APNG frame decoders can share one table.
+    virtual bool createColorTable(const SkImageInfo& dstInfo);
+    // Creates the swizzler initializeSwizzler() sets up. Virtual so APNG frame decoders can
+    // keep the swizzlers of frames of other widths instead of rebuilding them.
+    virtual std::unique_ptr<SkSwizzler> makeSwizzler(const SkImageInfo& swizzlerInfo,
+                                                     const Options&, bool skipFormatConversion);
     // Helper to set up swizzler, color xforms, and color table. Also calls png_read_update_info.
     SkCodec::Result initializeXforms(const SkImageInfo& dstInfo, const Options&);
     void initializeSwizzler(const SkImageInfo& dstInfo, const Options&, bool skipFormatConversion);
+    // Palette images only: sets up rows to be copied as raw indices, with no swizzler,
+    // color table or color xform. Also calls png_read_update_info.
+    Result initializeIndexXforms();
+    // 16-bit RGB and RGBA images only: sets up whole rows to be converted from big-endian
+    // U16 to dstInfo (F16) in one pass, without swizzling to 8 bits first, through its own
+    // color xform from the encoded color space. For APNG frame decoders, which decode
+    // without SkCodec's color xform. Also calls png_read_update_info.
+    Result initializeWideXforms(const SkImageInfo& dstInfo);
     void allocateStorage(const SkImageInfo& dstInfo);
     void destroyReadStruct();
+    // kSwizzleColor_XformMode for whole 8-bit rows: expands src to RGBA and transforms it
+    // into dst in chunks, so the intermediate stays in L1.
+    void fusedXformRow(void* dst, const void* src);
 
     virtual Result decodeAllRows(void* dst, size_t rowBytes, int* rowsDecoded) = 0;
     virtual void setRange(int firstRow, int lastRow, void* dst, size_t rowBytes) = 0;
@@ -114,10 +156,31 @@ protected:
 
     XformMode                      fXformMode;
     int                            fXformWidth;
+    // Width of the rows libpng produces: the image width, or the current frame's for APNG
+    // frame decoders, which are reused across frames of different sizes.
+    int                            fRowWidth;
+    // Bytes per dst pixel if applyXformRow may use fusedXformRow while the swizzler covers
+    // whole rows, else 0.
+    int                            fFusedXformBpp;
+    // Whether whole palette rows are expanded with a table lookup instead of the swizzler.
+    bool                           fExpandPalette;
+    // kWideF16_XformMode: the xform to the dst color space fWideXformDst (nullptr if there
+    // is nothing to convert), the encoded row format and the alpha type rows are converted
+    // to. The xform is kept while the dst color space stays the same.
+    std::unique_ptr<SkColorSpaceXform> fWideXform;
+    sk_sp<SkColorSpace>            fWideXformDst;
+    SkColorSpaceXform::ColorFormat fWideSrcFormat;
+    SkAlphaType                    fWideAlphaType;
 
     size_t                         fIdatLength;
     bool                           fDecodedIdat;
 
+    SkExecutor*                    fRowExecutor;
+    int                            fRowWorkers;
+    bool                           fFusedXformRows;
+
+    friend class SkPngRowPipeline;
+
     typedef SkCodec INHERITED;
 };
 #endif  // SkPngCodec_DEFINED
@@ -0,0 +1,358 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include "SkAPngEncoder.h"
+#include "SkData.h"
+#include "SkExecutor.h"
+#include "SkStream.h"
+#include "SkTaskGroup.h"
+
+#include "png.h"
+
+#include <vector>
+
+// This warning triggers false postives way too often in here.
+#if defined(__GNUC__) && !defined(__clang__)
+	#pragma GCC diagnostic ignored "-Wclobbered"
+#endif
+
+// fcTL dispose_op and blend_op values.
+enum {
+	kDisposeNone = 0,
+	kDisposeBackground = 1,
+	kDisposePrevious = 2,
+};
+enum {
+	kBlendSource = 0,
+	kBlendOver = 1,
+};
+
+// OVER costs the decoder a blend per pixel, so it is only used when at least this fraction
+// of the frame rect is unchanged and can be left transparent, which compresses to almost
+// nothing.
+static const int kOverMinUnchangedDenominator = 4;
+
+struct SkAPngEncodeFrame {
+	SkIRect               m_rect;
+	uint8_t               m_dispose;
+	uint8_t               m_blend;
+	// m_rect of the frame as stored, unpremul RGBA.
+	std::vector<uint32_t> m_pixels;
+	// zlib stream of m_pixels, as it goes in IDAT/fdAT.
+	sk_sp<SkData>         m_data;
+};
+
+static inline uint8_t alpha_of(uint32_t rgba)
+{
+	return reinterpret_cast<const uint8_t*>(&rgba)[3];
+}
+
+// Bounding rect of the pixels that differ between a and b, empty if none do.
+static SkIRect diff_rect(const uint32_t* a, const uint32_t* b, int width, int height)
+{
+	int top = -1, bottom = -1, left = width, right = -1;
+	for (int y = 0; y < height; y++)
+	{
+		const uint32_t* rowA = a + y * width;
+		const uint32_t* rowB = b + y * width;
+		if (!memcmp(rowA, rowB, width * sizeof(uint32_t)))
+			continue;
+
+		if (top < 0)
+			top = y;
+		bottom = y;
+		int x0 = 0;
+		while (rowA[x0] == rowB[x0])
+			x0++;
+		int x1 = width - 1;
+		while (rowA[x1] == rowB[x1])
+			x1--;
+		left = SkTMin(left, x0);
+		right = SkTMax(right, x1);
+	}
+	if (top < 0)
+		return SkIRect::MakeEmpty();
+	return SkIRect::MakeLTRB(left, top, right + 1, bottom + 1);
+}
+
+static void write_to_stream(png_structp png_ptr, png_bytep data, png_size_t len)
+{
+	SkWStream* stream = static_cast<SkWStream*>(png_get_io_ptr(png_ptr));
+	if (!stream->write(data, len))
+		png_error(png_ptr, "sk_write_fn Error!");
+}
+
+static void flush_stream(png_structp) {}
+
+// Compresses width x height RGBA pixels (RGB if !hasAlpha) and returns the payload of the
+// resulting IDAT chunks, which frames of an APNG share with the main image.
+static sk_sp<SkData> compress_frame(const uint32_t* pixels, int width, int height, bool hasAlpha, int zlibLevel)
+{
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	if (!png_ptr)
+		return nullptr;
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr)
+	{
+		png_destroy_write_struct(&png_ptr, nullptr);
+		return nullptr;
+	}
+
+	SkDynamicMemoryWStream encoded;
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		return nullptr;
+	}
+
+	png_set_write_fn(png_ptr, &encoded, write_to_stream, flush_stream);
+	png_set_compression_level(png_ptr, zlibLevel);
+	png_set_IHDR(png_ptr, info_ptr, width, height, 8,
+		hasAlpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+		PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png_ptr, info_ptr);
+	if (!hasAlpha)
+	{
+		// Drop the (opaque) alpha byte of each pixel.
+		png_set_filler(png_ptr, 0, PNG_FILLER_AFTER);
+	}
+	for (int y = 0; y < height; y++)
+		png_write_row(png_ptr, (png_bytep) (pixels + y * width));
+	png_write_end(png_ptr, info_ptr);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+
+	sk_sp<SkData> png = encoded.detachAsData();
+	SkDynamicMemoryWStream idat;
+	const uint8_t* chunk = png->bytes() + 8;
+	const uint8_t* end = png->bytes() + png->size();
+	while (chunk + 12 <= end)
+	{
+		const size_t length = png_get_uint_32(chunk);
+		if (length > (size_t)(end - chunk) - 12)
+			return nullptr;
+		if (!memcmp(chunk + 4, "IDAT", 4))
+			idat.write(chunk + 8, length);
+		chunk += 12 + length;
+	}
+	return idat.detachAsData();
+}
+
+// Plans frame i (> 0) against the previous one: picks the disposal of frames[i - 1] that
+// leaves the smallest rect to redraw, then the blend op and pixels of frames[i].
+// prevBase is what frames[i - 1] was drawn over; it is updated to what frames[i] is drawn
+// over.
+static void plan_frame(SkAPngEncodeFrame* prevFrame, SkAPngEncodeFrame* frame, const std::vector<uint32_t>& last,
+	const std::vector<uint32_t>& target, std::vector<uint32_t>* prevBase, bool isSecondFrame,
+	bool hasAlpha, int width, int height)
+{
+	std::vector<uint32_t> background = last;
+	const SkIRect& lastRect = prevFrame->m_rect;
+	for (int y = lastRect.fTop; y < lastRect.fBottom; y++)
+		memset(&background[y * width + lastRect.fLeft], 0, lastRect.width() * sizeof(uint32_t));
+
+	// In the order the decoder prefers them: NONE leaves the canvas alone, BACKGROUND clears
+	// a rect, PREVIOUS makes it keep a copy of the canvas. PREVIOUS on the first frame acts
+	// as BACKGROUND, so it is not tried there.
+	const struct {
+		uint8_t                      fDispose;
+		const std::vector<uint32_t>* fBase;
+	} candidates[] = {
+		{ kDisposeNone, &last },
+		{ kDisposeBackground, &background },
+		{ kDisposePrevious, prevBase },
+	};
+	const int candidateCount = isSecondFrame ? 2 : 3;
+
+	int best = 0;
+	SkIRect bestRect = diff_rect(last.data(), target.data(), width, height);
+	for (int c = 1; c < candidateCount; c++)
+	{
+		const SkIRect rect = diff_rect(candidates[c].fBase->data(), target.data(), width, height);
+		if ((int64_t)rect.width() * rect.height() < (int64_t)bestRect.width() * bestRect.height())
+		{
+			best = c;
+			bestRect = rect;
+		}
+	}
+	prevFrame->m_dispose = candidates[best].fDispose;
+	const std::vector<uint32_t>& base = *candidates[best].fBase;
+
+	// A frame identical to what it is drawn over still needs a non-empty rect.
+	frame->m_rect = bestRect.isEmpty() ? SkIRect::MakeWH(1, 1) : bestRect;
+	const SkIRect& rect = frame->m_rect;
+
+	// OVER keeps what is below where the frame is transparent, and replaces it where the
+	// frame is opaque. So it works if every changed pixel is opaque.
+	int unchanged = 0;
+	bool canBlendOver = hasAlpha;
+	for (int y = rect.fTop; y < rect.fBottom; y++)
+	{
+		for (int x = rect.fLeft; x < rect.fRight; x++)
+		{
+			const uint32_t pixel = target[y * width + x];
+			if (pixel == base[y * width + x])
+				unchanged++;
+			else if (alpha_of(pixel) != 0xFF)
+				canBlendOver = false;
+		}
+	}
+	const bool over = canBlendOver &&
+		unchanged * kOverMinUnchangedDenominator >= rect.width() * rect.height();
+	frame->m_blend = over ? kBlendOver : kBlendSource;
+
+	frame->m_pixels.resize(rect.width() * rect.height());
+	uint32_t* dst = frame->m_pixels.data();
+	for (int y = rect.fTop; y < rect.fBottom; y++)
+	{
+		for (int x = rect.fLeft; x < rect.fRight; x++)
+		{
+			const uint32_t pixel = target[y * width + x];
+			*dst++ = over && pixel == base[y * width + x] ? 0 : pixel;
+		}
+	}
+
+	if (&base != prevBase)
+		*prevBase = base;
+}
+
+static void delay_fraction(int ms, png_uint_16* num, png_uint_16* den)
+{
+	png_uint_32 value = SkTMax(ms, 0);
+	png_uint_32 scale = 1000;
+	while (value > 0xFFFF && scale > 1)
+	{
+		value /= 10;
+		scale /= 10;
+	}
+	*num = (png_uint_16) SkTMin<png_uint_32>(value, 0xFFFF);
+	*den = (png_uint_16) scale;
+}
+
+bool SkAPngEncoder::Encode(SkWStream* dst, const SkPixmap frames[], const int durations[],
+	int frameCount, const Options& options)
+{
+	if (!dst || frameCount <= 0 || frames[0].width() <= 0 || frames[0].height() <= 0)
+		return false;
+	const int width = frames[0].width();
+	const int height = frames[0].height();
+	bool hasAlpha = false;
+	for (int i = 0; i < frameCount; i++)
+	{
+		if (frames[i].width() != width || frames[i].height() != height || !frames[i].addr())
+			return false;
+		hasAlpha |= !frames[i].info().isOpaque() && !frames[i].computeIsOpaque();
+	}
+
+	// Full canvases: the frame being planned (target), the one before it (last) and what
+	// that one was drawn over (prevBase), plus the cleared copy of last that plan_frame()
+	// makes while it runs. Each plan keeps only its rect, until it is compressed.
+	const size_t pixelCount = (size_t) width * height;
+	std::vector<uint32_t> last(pixelCount), target(pixelCount);
+	std::vector<uint32_t> prevBase(pixelCount, 0);
+	auto readFrame = [&](int i, std::vector<uint32_t>* pixels) {
+		const SkImageInfo rgbaInfo = SkImageInfo::Make(width, height, kRGBA_8888_SkColorType,
+			kUnpremul_SkAlphaType, frames[i].info().refColorSpace());
+		return frames[i].readPixels(rgbaInfo, pixels->data(), width * sizeof(uint32_t), 0, 0);
+	};
+
+	// The pixels of a plan are final once it is planned (planning the next frame only sets
+	// its dispose op), so each is compressed right away while the following frames are
+	// planned. The group is declared after plans so that it is waited for first.
+	std::vector<SkAPngEncodeFrame> plans(frameCount);
+	SkTaskGroup group(options.fExecutor ? *options.fExecutor : SkExecutor::GetDefault());
+	const int zlibLevel = SkTPin(options.fZLibLevel, 0, 9);
+	auto compress = [&plans, hasAlpha, zlibLevel](int i) {
+		SkAPngEncodeFrame& frame = plans[i];
+		frame.m_data = compress_frame(frame.m_pixels.data(), frame.m_rect.width(),
+			frame.m_rect.height(), hasAlpha, zlibLevel);
+		std::vector<uint32_t>().swap(frame.m_pixels);
+	};
+
+	if (!readFrame(0, &last))
+		return false;
+	plans[0].m_rect = SkIRect::MakeWH(width, height);
+	plans[0].m_blend = kBlendSource;
+	plans[0].m_pixels = last;
+	group.add([compress] { compress(0); });
+	for (int i = 1; i < frameCount; i++)
+	{
+		if (!readFrame(i, &target))
+			return false;
+		plan_frame(&plans[i - 1], &plans[i], last, target, &prevBase, 1 == i, hasAlpha, width, height);
+		group.add([compress, i] { compress(i); });
+		last.swap(target);
+	}
+	plans[frameCount - 1].m_dispose = kDisposeNone;
+	group.wait();
+	for (const SkAPngEncodeFrame& frame : plans)
+	{
+		if (!frame.m_data || frame.m_data->size() > PNG_UINT_31_MAX - 4)
+			return false;
+	}
+
+	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	if (!png_ptr)
+		return false;
+	if (setjmp(png_jmpbuf(png_ptr)))
+	{
+		png_destroy_write_struct(&png_ptr, nullptr);
+		return false;
+	}
+	png_set_write_fn(png_ptr, dst, write_to_stream, flush_stream);
+	png_write_sig(png_ptr);
+
+	png_byte ihdr[13];
+	png_save_uint_32(ihdr, width);
+	png_save_uint_32(ihdr + 4, height);
+	ihdr[8] = 8;
+	ihdr[9] = hasAlpha ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+	ihdr[10] = PNG_COMPRESSION_TYPE_BASE;
+	ihdr[11] = PNG_FILTER_TYPE_BASE;
+	ihdr[12] = PNG_INTERLACE_NONE;
+	png_write_chunk(png_ptr, (png_const_bytep) "IHDR", ihdr, sizeof(ihdr));
+
+	png_byte actl[8];
+	png_save_uint_32(actl, frameCount);
+	png_save_uint_32(actl + 4, SkTMax(options.fPlayCount, 0));
+	png_write_chunk(png_ptr, (png_const_bytep) "acTL", actl, sizeof(actl));
+
+	png_uint_32 sequence = 0;
+	for (int i = 0; i < frameCount; i++)
+	{
+		const SkAPngEncodeFrame& frame = plans[i];
+		png_byte fctl[26];
+		png_uint_16 delayNum, delayDen;
+		delay_fraction(durations ? durations[i] : 0, &delayNum, &delayDen);
+		png_save_uint_32(fctl, sequence++);
+		png_save_uint_32(fctl + 4, frame.m_rect.width());
+		png_save_uint_32(fctl + 8, frame.m_rect.height());
+		png_save_uint_32(fctl + 12, frame.m_rect.fLeft);
+		png_save_uint_32(fctl + 16, frame.m_rect.fTop);
+		png_save_uint_16(fctl + 20, delayNum);
+		png_save_uint_16(fctl + 22, delayDen);
+		fctl[24] = frame.m_dispose;
+		fctl[25] = frame.m_blend;
+		png_write_chunk(png_ptr, (png_const_bytep) "fcTL", fctl, sizeof(fctl));
+
+		if (0 == i)
+		{
+			png_write_chunk(png_ptr, (png_const_bytep) "IDAT", frame.m_data->bytes(), frame.m_data->size());
+		}
+		else
+		{
+			png_byte sequenceNumber[4];
+			png_save_uint_32(sequenceNumber, sequence++);
+			png_write_chunk_start(png_ptr, (png_const_bytep) "fdAT", (png_uint_32) frame.m_data->size() + 4);
+			png_write_chunk_data(png_ptr, sequenceNumber, sizeof(sequenceNumber));
+			png_write_chunk_data(png_ptr, frame.m_data->bytes(), frame.m_data->size());
+			png_write_chunk_end(png_ptr);
+		}
+	}
+	png_write_chunk(png_ptr, (png_const_bytep) "IEND", nullptr, 0);
+	png_destroy_write_struct(&png_ptr, nullptr);
+	return true;
+}
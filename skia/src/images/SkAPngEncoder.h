@@ -0,0 +1,46 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+#ifndef SkAPngEncoder_DEFINED
+#define SkAPngEncoder_DEFINED
+
+#include "SkPixmap.h"
+
+class SkExecutor;
+class SkWStream;
+
+class SK_API SkAPngEncoder {
+public:
+	struct Options {
+		// Times the animation plays, 0 for forever.
+		int         fPlayCount = 0;
+
+		// zlib compression level, 0 (none) to 9 (smallest).
+		int         fZLibLevel = 6;
+
+		// Frames are compressed in parallel on this executor (SkExecutor::GetDefault() if
+		// nullptr).
+		SkExecutor* fExecutor = nullptr;
+	};
+
+	/**
+	 *  Encodes frames as an APNG that SkAPngCodec decodes back to the same pixels. Frame i
+	 *  is shown for durations[i] milliseconds; all frames must have the same size.
+	 *
+	 *  Each frame after the first stores only the rect that differs from what it is drawn
+	 *  over. The disposal of the previous frame is picked to make that rect smallest, and
+	 *  a frame is blended OVER (with unchanged pixels left transparent) only when that
+	 *  leaves a good part of the rect empty; otherwise SOURCE, which is cheaper to decode.
+	 *  Animations without any transparency are written as RGB.
+	 *
+	 *  Returns false if there are no frames, their sizes differ, or one cannot be read as
+	 *  8-bit RGBA.
+	 */
+	static bool Encode(SkWStream* dst, const SkPixmap frames[], const int durations[],
+		int frameCount, const Options& options);
+};
+
+#endif  // SkAPngEncoder_DEFINED
@@ -0,0 +1,915 @@
+/*
+ * Copyright 2017 IQY Inc.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+// Headless benchmark of PNG/APNG decoding through SkCodec.
+//
+// Runs over a corpus generated in memory (interlaced and non-interlaced, palette and RGBA,
+// every dispose_op/blend_op combination, frames of varying size and placement, a single
+// frame) and, optionally, over files given with --images.
+// For each input it measures codec open time, time to first frame, per-frame decode
+// latency (p50/p99), full-animation throughput (serial, and parallel with --threads),
+// reopening with and without a saved frame index, for single-frame PNGs a plain libpng
+// header read to compare open time with, heap allocations made by frame decoding
+// when the animation loops, and peak RSS, and writes one JSON object per line. It then checks
+// that SkAPngEncoder round-trips two generated clips, and compares fused and two-pass
+// swizzle + color xform rows for each 8-bit encoded layout.
+
+#include "SkAPngCodec.h"
+#include "SkAPngEncoder.h"
+#include "SkBitmap.h"
+#include "SkCodec.h"
+#include "SkColorSpace.h"
+#include "SkCommandLineFlags.h"
+#include "SkData.h"
+#include "SkExecutor.h"
+#include "SkOSFile.h"
+#include "SkOSPath.h"
+#include "SkOpts.h"
+#include "SkPngCodec.h"
+#include "SkRect.h"
+#include "SkStream.h"
+#include "SkString.h"
+#include "SkTArray.h"
+#include "SkTime.h"
+
+#include "png.h"
+
+#include <algorithm>
+#include <vector>
+
+#if defined(SK_BUILD_FOR_UNIX) || defined(SK_BUILD_FOR_MAC) || defined(SK_BUILD_FOR_ANDROID)
+    #include <sys/resource.h>
+#endif
+
+DEFINE_int32(loops, 5, "Times each input is decoded.");
+DEFINE_int32(size, 256, "Width and height of generated animations.");
+DEFINE_int32(frames, 24, "Frames per generated animation.");
+DEFINE_int32(threads, 0, "If > 0, also measure parallel decoding on this many threads.");
+DEFINE_string(images, "", "Extra PNG/APNG files or directories to benchmark.");
+DEFINE_string(match, "", "Only run inputs whose name contains one of these substrings.");
+DEFINE_string(json, "", "Write results here instead of stdout.");
+DEFINE_string(writeCorpus, "", "If set, also write the generated corpus to this directory.");
+DEFINE_bool(xformRows, true, "Compare fused and two-pass swizzle + color xform rows.");
+DEFINE_int32(rowWorkers, 0, "If > 0, also time xform rows pipelined to this many workers.");
+
+///////////////////////////////////////////////////////////////////////////////
+// Corpus generation
+///////////////////////////////////////////////////////////////////////////////
+
+static uint32_t crc32_png(uint32_t crc, const uint8_t* data, size_t len) {
+    static uint32_t table[256];
+    static bool tableReady = false;
+    if (!tableReady) {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+        tableReady = true;
+    }
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void write_chunk(SkDynamicMemoryWStream* out, const char tag[4], const void* data,
+                        size_t len) {
+    uint8_t header[8];
+    put_u32(header, (uint32_t)len);
+    memcpy(header + 4, tag, 4);
+    out->write(header, 8);
+    out->write(data, len);
+    uint32_t crc = crc32_png(0, header + 4, 4);
+    crc = crc32_png(crc, (const uint8_t*)data, len);
+    uint8_t crcBytes[4];
+    put_u32(crcBytes, crc);
+    out->write(crcBytes, 4);
+}
+
+struct Chunk {
+    SkString             fTag;
+    std::vector<uint8_t> fData;
+};
+
+static void png_write_to_stream(png_structp png_ptr, png_bytep data, png_size_t len) {
+    static_cast<SkDynamicMemoryWStream*>(png_get_io_ptr(png_ptr))->write(data, len);
+}
+
+static void png_flush_stream(png_structp) {}
+
+enum class Color { kPalette, kRGBA };
+
+// Encodes one frame with libpng and returns its chunks.
+static std::vector<Chunk> encode_frame(const std::vector<uint8_t>& pixels, int width, int height,
+                                       Color color, bool interlaced,
+                                       const std::vector<png_color>& palette,
+                                       const std::vector<png_byte>& trans) {
+    std::vector<Chunk> chunks;
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                                  nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    SkDynamicMemoryWStream encoded;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return chunks;
+    }
+
+    png_set_write_fn(png_ptr, &encoded, png_write_to_stream, png_flush_stream);
+    const int colorType = Color::kPalette == color ? PNG_COLOR_TYPE_PALETTE
+                                                    : PNG_COLOR_TYPE_RGB_ALPHA;
+    png_set_IHDR(png_ptr, info_ptr, width, height, 8, colorType,
+                 interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (Color::kPalette == color) {
+        png_set_PLTE(png_ptr, info_ptr, palette.data(), (int)palette.size());
+        png_set_tRNS(png_ptr, info_ptr, trans.data(), (int)trans.size(), nullptr);
+    }
+    png_write_info(png_ptr, info_ptr);
+
+    const size_t rowBytes = width * (Color::kPalette == color ? 1 : 4);
+    std::vector<png_bytep> rows(height);
+    for (int y = 0; y < height; y++) {
+        rows[y] = const_cast<png_bytep>(pixels.data() + y * rowBytes);
+    }
+    png_write_image(png_ptr, rows.data());
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    sk_sp<SkData> data = encoded.detachAsData();
+    const uint8_t* p = data->bytes() + 8;
+    const uint8_t* end = data->bytes() + data->size();
+    while (p + 12 <= end) {
+        const uint32_t len = png_get_uint_32(p);
+        Chunk chunk;
+        chunk.fTag.set((const char*)p + 4, 4);
+        chunk.fData.assign(p + 8, p + 8 + len);
+        chunks.push_back(std::move(chunk));
+        p += 12 + len;
+    }
+    return chunks;
+}
+
+// Deterministic frame content: a moving gradient with a ring of partial alpha, so both
+// blend ops and every dispose op change the composited result.
+static std::vector<uint8_t> make_frame_pixels(int width, int height, int frame, Color color) {
+    const int bpp = Color::kPalette == color ? 1 : 4;
+    std::vector<uint8_t> pixels(width * height * bpp);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const int dx = x - width / 2, dy = y - height / 2;
+            const int d2 = (dx * dx + dy * dy) * 16 / (width * width + 1);
+            uint8_t* px = &pixels[(y * width + x) * bpp];
+            if (Color::kPalette == color) {
+                px[0] = (uint8_t)((x / 4 + y / 4 + frame * 3) & 0xff);
+            } else {
+                px[0] = (uint8_t)(x * 255 / width + frame * 8);
+                px[1] = (uint8_t)(y * 255 / height);
+                px[2] = (uint8_t)(frame * 16);
+                px[3] = d2 < 2 ? 255 : d2 < 4 ? 128 : 0;
+            }
+        }
+    }
+    return pixels;
+}
+
+struct CorpusEntry {
+    SkString      fName;
+    sk_sp<SkData> fData;
+};
+
+// Where the frames after frame 0 go.
+enum class Rects {
+    kQuarter,   // Moving quarter-size rects.
+    kSizes,     // Rects of a different size every frame.
+    kEdges,     // The whole canvas, single pixels, strips and corners, in turn.
+};
+
+static SkIRect frame_rect(Rects rects, int size, int frame) {
+    if (0 == frame) {
+        return SkIRect::MakeWH(size, size);
+    }
+    if (Rects::kEdges == rects) {
+        const int third = std::max(1, size / 3);
+        switch (frame % 6) {
+            case 0:  return SkIRect::MakeWH(size, size);
+            case 1:  return SkIRect::MakeWH(1, 1);
+            case 2:  return SkIRect::MakeLTRB(size - third, size - third, size, size);
+            case 3:  return SkIRect::MakeXYWH(0, (frame * 5) % (size - third + 1), size, third);
+            case 4:  return SkIRect::MakeXYWH((frame * 7) % (size - third + 1), 0, third, size);
+            default: return SkIRect::MakeXYWH(size - 1, size - 1, 1, 1);
+        }
+    }
+    int width = size / 2, height = size / 2;
+    if (Rects::kSizes == rects) {
+        // Grows and shrinks, so frame decoders see both wider and narrower frames.
+        static const int kEighths[] = { 1, 7, 3, 8, 2, 5 };
+        width = std::max(1, size * kEighths[frame % 6] / 8);
+        height = std::max(1, size * kEighths[(frame + 2) % 6] / 8);
+    }
+    return SkIRect::MakeXYWH((frame * 7) % (size - width + 1), (frame * 5) % (size - height + 1),
+                             width, height);
+}
+
+static sk_sp<SkData> make_apng(int size, int frameCount, Color color, bool interlaced,
+                               int disposeOp, int blendOp, Rects rects = Rects::kQuarter) {
+    std::vector<png_color> palette(256);
+    std::vector<png_byte> trans(256);
+    for (int i = 0; i < 256; i++) {
+        palette[i].red = (png_byte)i;
+        palette[i].green = (png_byte)(255 - i);
+        palette[i].blue = (png_byte)(i * 7);
+        trans[i] = (png_byte)(i % 3 == 0 ? 0 : i % 3 == 1 ? 128 : 255);
+    }
+
+    SkDynamicMemoryWStream out;
+    static const uint8_t kSignature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    out.write(kSignature, sizeof(kSignature));
+
+    uint32_t sequence = 0;
+    for (int frame = 0; frame < frameCount; frame++) {
+        // Frame 0 covers the canvas.
+        const SkIRect rect = frame_rect(rects, size, frame);
+        const int width = rect.width();
+        const int height = rect.height();
+        const int x = rect.x();
+        const int y = rect.y();
+        std::vector<Chunk> chunks = encode_frame(make_frame_pixels(width, height, frame, color),
+                                                 width, height, color, interlaced, palette, trans);
+
+        if (0 == frame) {
+            for (const Chunk& chunk : chunks) {
+                if (chunk.fTag.equals("IHDR")) {
+                    write_chunk(&out, "IHDR", chunk.fData.data(), chunk.fData.size());
+                    uint8_t actl[8];
+                    put_u32(actl, frameCount);
+                    put_u32(actl + 4, 0);
+                    write_chunk(&out, "acTL", actl, sizeof(actl));
+                } else if (chunk.fTag.equals("PLTE") || chunk.fTag.equals("tRNS")) {
+                    write_chunk(&out, chunk.fTag.c_str(), chunk.fData.data(), chunk.fData.size());
+                }
+            }
+        }
+
+        uint8_t fctl[26];
+        put_u32(fctl, sequence++);
+        put_u32(fctl + 4, width);
+        put_u32(fctl + 8, height);
+        put_u32(fctl + 12, x);
+        put_u32(fctl + 16, y);
+        fctl[20] = 0; fctl[21] = 10;  // delay 10/100 s
+        fctl[22] = 0; fctl[23] = 100;
+        fctl[24] = (uint8_t)disposeOp;
+        fctl[25] = (uint8_t)blendOp;
+        write_chunk(&out, "fcTL", fctl, sizeof(fctl));
+
+        for (const Chunk& chunk : chunks) {
+            if (!chunk.fTag.equals("IDAT")) {
+                continue;
+            }
+            if (0 == frame) {
+                write_chunk(&out, "IDAT", chunk.fData.data(), chunk.fData.size());
+            } else {
+                std::vector<uint8_t> fdat(4 + chunk.fData.size());
+                put_u32(fdat.data(), sequence++);
+                memcpy(fdat.data() + 4, chunk.fData.data(), chunk.fData.size());
+                write_chunk(&out, "fdAT", fdat.data(), fdat.size());
+            }
+        }
+    }
+    write_chunk(&out, "IEND", nullptr, 0);
+    return out.detachAsData();
+}
+
+// A static PNG: frame 0 of make_apng, without acTL or fcTL.
+static sk_sp<SkData> make_png(int size, Color color, bool interlaced) {
+    std::vector<png_color> palette(256);
+    std::vector<png_byte> trans(256);
+    for (int i = 0; i < 256; i++) {
+        palette[i].red = (png_byte)i;
+        palette[i].green = (png_byte)(255 - i);
+        palette[i].blue = (png_byte)(i * 7);
+        trans[i] = (png_byte)(i % 3 == 0 ? 0 : i % 3 == 1 ? 128 : 255);
+    }
+
+    SkDynamicMemoryWStream out;
+    static const uint8_t kSignature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    out.write(kSignature, sizeof(kSignature));
+    for (const Chunk& chunk : encode_frame(make_frame_pixels(size, size, 0, color), size, size,
+                                           color, interlaced, palette, trans)) {
+        write_chunk(&out, chunk.fTag.c_str(), chunk.fData.data(), chunk.fData.size());
+    }
+    return out.detachAsData();
+}
+
+static void make_corpus(SkTArray<CorpusEntry>* corpus) {
+    static const char* kDispose[] = { "none", "background", "previous" };
+    static const char* kBlend[] = { "source", "over" };
+    for (Color color : { Color::kPalette, Color::kRGBA }) {
+        for (bool interlaced : { false, true }) {
+            for (int dispose = 0; dispose < 3; dispose++) {
+                for (int blend = 0; blend < 2; blend++) {
+                    CorpusEntry& entry = corpus->push_back();
+                    entry.fName.printf("gen_%s_%s_%s_%s",
+                                       Color::kPalette == color ? "palette" : "rgba",
+                                       interlaced ? "interlaced" : "progressive",
+                                       kDispose[dispose], kBlend[blend]);
+                    entry.fData = make_apng(FLAGS_size, FLAGS_frames, color, interlaced,
+                                            dispose, blend);
+                }
+            }
+        }
+
+        // Frames of every size share one frame decoder. Looping only allocates the
+        // swizzlers rebuilt when the frame width changes.
+        CorpusEntry& entry = corpus->push_back();
+        entry.fName.printf("gen_%s_progressive_sizes_none_over",
+                           Color::kPalette == color ? "palette" : "rgba");
+        entry.fData = make_apng(FLAGS_size, FLAGS_frames, color, false, 0, 1, Rects::kSizes);
+
+        // Frames at the canvas edges and corners, some of them a pixel wide, under every
+        // dispose_op.
+        for (bool interlaced : { false, true }) {
+            for (int dispose = 0; dispose < 3; dispose++) {
+                CorpusEntry& edges = corpus->push_back();
+                edges.fName.printf("gen_%s_%s_edges_%s_over",
+                                   Color::kPalette == color ? "palette" : "rgba",
+                                   interlaced ? "interlaced" : "progressive", kDispose[dispose]);
+                edges.fData = make_apng(FLAGS_size, FLAGS_frames, color, interlaced, dispose, 1,
+                                        Rects::kEdges);
+            }
+        }
+
+        // An APNG with a single frame, which is the default image.
+        CorpusEntry& single = corpus->push_back();
+        single.fName.printf("gen_%s_progressive_single_frame",
+                            Color::kPalette == color ? "palette" : "rgba");
+        single.fData = make_apng(FLAGS_size, 1, color, false, 0, 0);
+
+        // Static PNGs, whose open time should match reading the header alone.
+        for (bool interlaced : { false, true }) {
+            CorpusEntry& png = corpus->push_back();
+            png.fName.printf("gen_%s_%s_static", Color::kPalette == color ? "palette" : "rgba",
+                             interlaced ? "interlaced" : "progressive");
+            png.fData = make_png(FLAGS_size, color, interlaced);
+        }
+    }
+}
+
+static void add_file(SkTArray<CorpusEntry>* corpus, const SkString& path) {
+    sk_sp<SkData> data = SkData::MakeFromFileName(path.c_str());
+    if (data) {
+        CorpusEntry& entry = corpus->push_back();
+        entry.fName = SkOSPath::Basename(path.c_str());
+        entry.fData = std::move(data);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Measurement
+///////////////////////////////////////////////////////////////////////////////
+
+static long peak_rss_kb() {
+#if defined(SK_BUILD_FOR_UNIX) || defined(SK_BUILD_FOR_MAC) || defined(SK_BUILD_FOR_ANDROID)
+    struct rusage usage;
+    if (0 == getrusage(RUSAGE_SELF, &usage)) {
+    #if defined(SK_BUILD_FOR_MAC)
+        return usage.ru_maxrss / 1024;
+    #else
+        return usage.ru_maxrss;
+    #endif
+    }
+#endif
+    return -1;
+}
+
+static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+        return 0;
+    }
+    const size_t index = std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5));
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+static double to_us(double nanos) { return nanos / 1000.0; }
+
+struct Results {
+    std::vector<double> fOpen;
+    std::vector<double> fFirstFrame;
+    std::vector<double> fFrames;
+    std::vector<double> fAnimation;
+    std::vector<double> fParallel;
+    std::vector<double> fScanOpen;
+    std::vector<double> fIndexedOpen;
+    std::vector<double> fReadHeader;
+    int                 fReplayAllocations = 0;
+    int                 fFrameCount = 0;
+    bool                fFailed = false;
+};
+
+static void header_info_callback(png_structp png_ptr, png_infop) {
+    *static_cast<bool*>(png_get_progressive_ptr(png_ptr)) = true;
+    png_process_data_pause(png_ptr, 0);
+}
+
+// Times what SkPngCodec's read_header does for a static PNG without the APNG probe: feeding
+// libpng the data until it has the IHDR (and the chunks before IDAT). The codec is not built.
+static void bench_read_header(const SkData* data, Results* results) {
+    const double start = SkTime::GetNSecs();
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                                 nullptr);
+    png_infop info_ptr = png_ptr ? png_create_info_struct(png_ptr) : nullptr;
+    if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+        results->fFailed = true;
+        return;
+    }
+
+    bool haveInfo = false;
+    png_set_progressive_read_fn(png_ptr, &haveInfo, header_info_callback, nullptr, nullptr);
+    // Fed 4 KB at a time; the callback pauses libpng once the header has been read.
+    constexpr size_t kBufferSize = 4096;
+    const png_byte* bytes = data->bytes();
+    for (size_t offset = 0; !haveInfo && offset < data->size(); offset += kBufferSize) {
+        png_process_data(png_ptr, info_ptr, const_cast<png_byte*>(bytes + offset),
+                         std::min(kBufferSize, data->size() - offset));
+    }
+    png_destroy_read_struct(&png_ptr, &info_ptr, nullptr);
+    if (!haveInfo) {
+        results->fFailed = true;
+    }
+    results->fReadHeader.push_back(SkTime::GetNSecs() - start);
+}
+
+// Times opening data and building its frame table, by scanning every chunk and from a
+// frame index saved by codec.
+static void bench_reopen(const SkData* data, SkAPngCodec* codec, Results* results) {
+    // A player hashes the file once, to look the index up in its cache.
+    const uint64_t contentHash = SkOpts::hash(data->data(), data->size());
+    sk_sp<SkData> index = codec->serializeFrameIndex(contentHash);
+    if (!index) {
+        results->fFailed = true;
+        return;
+    }
+
+    for (int indexed = 0; indexed < 2; indexed++) {
+        const double start = SkTime::GetNSecs();
+        std::unique_ptr<SkCodec> reopened(
+                SkCodec::MakeFromData(sk_ref_sp(const_cast<SkData*>(data))));
+        if (!reopened) {
+            results->fFailed = true;
+            return;
+        }
+        if (indexed && !static_cast<SkAPngCodec*>(reopened.get())->loadFrameIndex(
+                index->data(), index->size(), contentHash)) {
+            results->fFailed = true;
+        }
+        if (reopened->getFrameCount() != results->fFrameCount) {
+            results->fFailed = true;
+        }
+        (indexed ? results->fIndexedOpen : results->fScanOpen).push_back(
+                SkTime::GetNSecs() - start);
+    }
+
+    // An index saved for other content must be turned down.
+    std::unique_ptr<SkCodec> other(SkCodec::MakeFromData(sk_ref_sp(const_cast<SkData*>(data))));
+    if (!other || static_cast<SkAPngCodec*>(other.get())->loadFrameIndex(
+            index->data(), index->size(), contentHash + 1)) {
+        results->fFailed = true;
+    }
+}
+
+// Decodes every frame in order, as a player does: each frame starts from a copy of its
+// required frame.
+static void bench_once(const SkData* data, SkExecutor* executor, Results* results) {
+    double start = SkTime::GetNSecs();
+    std::unique_ptr<SkCodec> codec(SkCodec::MakeFromData(sk_ref_sp(const_cast<SkData*>(data))));
+    const double opened = SkTime::GetNSecs();
+    if (!codec) {
+        results->fFailed = true;
+        return;
+    }
+    results->fOpen.push_back(opened - start);
+
+    const SkImageInfo info = codec->getInfo().makeColorType(kN32_SkColorType)
+                                             .makeAlphaType(kPremul_SkAlphaType);
+    const int frameCount = codec->getFrameCount();
+    const std::vector<SkCodec::FrameInfo> frameInfos = codec->getFrameInfo();
+    results->fFrameCount = frameCount;
+
+    std::vector<SkBitmap> frames(frameCount);
+    double animationStart = SkTime::GetNSecs();
+    for (int i = 0; i < frameCount; i++) {
+        SkBitmap& bm = frames[i];
+        bm.allocPixels(info);
+        SkCodec::Options options;
+        options.fFrameIndex = i;
+        if (i < (int)frameInfos.size() && SkCodec::kNone != frameInfos[i].fRequiredFrame) {
+            const SkBitmap& required = frames[frameInfos[i].fRequiredFrame];
+            required.readPixels(info, bm.getPixels(), bm.rowBytes(), 0, 0);
+            options.fPriorFrame = frameInfos[i].fRequiredFrame;
+        }
+
+        const double frameStart = SkTime::GetNSecs();
+        const SkCodec::Result result = codec->getPixels(info, bm.getPixels(), bm.rowBytes(),
+                                                        &options);
+        const double frameEnd = SkTime::GetNSecs();
+        if (SkCodec::kSuccess != result) {
+            results->fFailed = true;
+        }
+        results->fFrames.push_back(frameEnd - frameStart);
+        if (0 == i) {
+            results->fFirstFrame.push_back(frameEnd - start);
+        }
+    }
+    results->fAnimation.push_back(SkTime::GetNSecs() - animationStart);
+
+    if (frameCount > 1 && SkEncodedImageFormat::kPNG == codec->getEncodedFormat()) {
+        // Play the animation a second time, as a looping player does. Frame decoding must
+        // not touch the heap any more, whatever the frame sizes.
+        SkAPngCodec* apngCodec = static_cast<SkAPngCodec*>(codec.get());
+        const int allocations = apngCodec->frameHeapAllocations();
+        for (int i = 1; i < frameCount; i++) {
+            SkCodec::Options options;
+            options.fFrameIndex = i;
+            options.fPriorFrame = i < (int)frameInfos.size() ? frameInfos[i].fRequiredFrame
+                                                             : SkCodec::kNone;
+            if (SkCodec::kNone != options.fPriorFrame) {
+                frames[options.fPriorFrame].readPixels(info, frames[i].getPixels(),
+                                                       frames[i].rowBytes(), 0, 0);
+            }
+            if (SkCodec::kSuccess != codec->getPixels(info, frames[i].getPixels(),
+                                                      frames[i].rowBytes(), &options)) {
+                results->fFailed = true;
+            }
+        }
+        const int replayAllocations = apngCodec->frameHeapAllocations() - allocations;
+        results->fReplayAllocations = std::max(results->fReplayAllocations, replayAllocations);
+        if (replayAllocations) {
+            results->fFailed = true;
+        }
+    }
+
+    if (executor && frameCount > 1 && SkEncodedImageFormat::kPNG == codec->getEncodedFormat()) {
+        // Only APNGs have more than one frame here.
+        SkAPngCodec* apngCodec = static_cast<SkAPngCodec*>(codec.get());
+        std::vector<void*> pixels(frameCount);
+        for (int i = 0; i < frameCount; i++) {
+            pixels[i] = frames[i].getPixels();
+        }
+        const double parallelStart = SkTime::GetNSecs();
+        if (SkCodec::kSuccess != apngCodec->getFramesPixels(info, pixels.data(),
+                                                            frames[0].rowBytes(), 0,
+                                                            frameCount - 1, executor)) {
+            results->fFailed = true;
+        }
+        results->fParallel.push_back(SkTime::GetNSecs() - parallelStart);
+    }
+
+    if (1 == frameCount && SkEncodedImageFormat::kPNG == codec->getEncodedFormat()) {
+        bench_read_header(data, results);
+    }
+
+    if (frameCount > 1 && SkEncodedImageFormat::kPNG == codec->getEncodedFormat()) {
+        bench_reopen(data, static_cast<SkAPngCodec*>(codec.get()), results);
+    }
+}
+
+static void report(SkWStream* out, const CorpusEntry& entry, const Results& results) {
+    SkString line;
+    line.appendf("{\"name\":\"%s\",\"bytes\":%zu,\"frames\":%d,\"loops\":%d,\"ok\":%s",
+                 entry.fName.c_str(), entry.fData->size(), results.fFrameCount, FLAGS_loops,
+                 results.fFailed ? "false" : "true");
+    line.appendf(",\"open_us\":%.1f", to_us(percentile(results.fOpen, 0.5)));
+    line.appendf(",\"first_frame_us\":%.1f", to_us(percentile(results.fFirstFrame, 0.5)));
+    line.appendf(",\"frame_p50_us\":%.1f", to_us(percentile(results.fFrames, 0.5)));
+    line.appendf(",\"frame_p99_us\":%.1f", to_us(percentile(results.fFrames, 0.99)));
+    const double animation = percentile(results.fAnimation, 0.5);
+    line.appendf(",\"animation_ms\":%.3f,\"frames_per_sec\":%.1f", animation / 1e6,
+                 animation > 0 ? results.fFrameCount * 1e9 / animation : 0.0);
+    if (!results.fParallel.empty()) {
+        const double parallel = percentile(results.fParallel, 0.5);
+        line.appendf(",\"threads\":%d,\"parallel_ms\":%.3f,\"parallel_frames_per_sec\":%.1f",
+                     FLAGS_threads, parallel / 1e6,
+                     parallel > 0 ? results.fFrameCount * 1e9 / parallel : 0.0);
+    }
+    if (!results.fIndexedOpen.empty()) {
+        line.appendf(",\"open_scan_us\":%.1f,\"open_indexed_us\":%.1f",
+                     to_us(percentile(results.fScanOpen, 0.5)),
+                     to_us(percentile(results.fIndexedOpen, 0.5)));
+    }
+    if (!results.fReadHeader.empty()) {
+        // Baseline for open_us: libpng reading the header, as upstream's codec does.
+        line.appendf(",\"read_header_us\":%.1f", to_us(percentile(results.fReadHeader, 0.5)));
+    }
+    if (results.fFrameCount > 1) {
+        line.appendf(",\"replay_heap_allocs\":%d", results.fReplayAllocations);
+    }
+    // Process-wide high-water mark, so it only grows from one input to the next.
+    line.appendf(",\"peak_rss_kb\":%ld}\n", peak_rss_kb());
+    out->writeText(line.c_str());
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Encoder round trip
+///////////////////////////////////////////////////////////////////////////////
+
+// An unpremul RGBA frame at step: an opaque gradient square moving down the diagonal and a
+// band moving across, over a transparent canvas with a half transparent band, or over an
+// opaque gradient with an opaque band.
+static void make_roundtrip_frame(SkBitmap* bm, int size, int step, bool opaque) {
+    bm->allocPixels(SkImageInfo::Make(size, size, kRGBA_8888_SkColorType,
+                                      kUnpremul_SkAlphaType));
+    const int side = std::max(size / 4, 1);
+    const int stride = std::max(size / 16, 1);
+    const SkIRect square = SkIRect::MakeXYWH(step * stride % (size - side + 1),
+                                             step * stride % (size - side + 1), side, side);
+    const SkIRect band = SkIRect::MakeXYWH(step * 2 * stride % (size - side + 1), size / 2,
+                                           side, std::max(side / 2, 1));
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            uint8_t* p = reinterpret_cast<uint8_t*>(bm->getAddr32(x, y));
+            if (square.contains(x, y)) {
+                p[0] = (uint8_t)(x * 5); p[1] = (uint8_t)(y * 3); p[2] = 0x40; p[3] = 0xFF;
+            } else if (band.contains(x, y)) {
+                p[0] = 0x20; p[1] = 0x90; p[2] = 0xE0; p[3] = opaque ? 0xFF : 0x80;
+            } else if (opaque) {
+                p[0] = (uint8_t)(x + y); p[1] = 0x60; p[2] = (uint8_t)(x ^ y); p[3] = 0xFF;
+            } else {
+                memset(p, 0, 4);
+            }
+        }
+    }
+}
+
+// Encodes each clip with SkAPngEncoder, decodes every frame back over its required frame
+// as a player does, and compares pixels and durations. Frame 2 repeats frame 1, so the
+// encoder also writes a frame with nothing changed. Returns the number of failed clips.
+static int bench_roundtrip(SkWStream* out, SkExecutor* executor) {
+    const int size = FLAGS_size;
+    const int frameCount = std::max(FLAGS_frames, 3);
+    const SkImageInfo info = SkImageInfo::Make(size, size, kRGBA_8888_SkColorType,
+                                               kUnpremul_SkAlphaType);
+    int failures = 0;
+    for (int opaque = 0; opaque < 2; opaque++) {
+        SkString name;
+        name.printf("encoder_roundtrip_%s", opaque ? "opaque" : "alpha");
+        if (SkCommandLineFlags::ShouldSkip(FLAGS_match, name.c_str())) {
+            continue;
+        }
+
+        std::vector<SkBitmap> frames(frameCount);
+        std::vector<SkPixmap> pixmaps(frameCount);
+        std::vector<int> durations(frameCount);
+        for (int i = 0; i < frameCount; i++) {
+            make_roundtrip_frame(&frames[i], size, 2 == i ? 1 : i, opaque);
+            frames[i].peekPixels(&pixmaps[i]);
+            durations[i] = 20 + 10 * (i % 3);
+        }
+
+        SkAPngEncoder::Options encodeOptions;
+        encodeOptions.fExecutor = executor;
+        SkDynamicMemoryWStream encoded;
+        const double start = SkTime::GetNSecs();
+        bool ok = SkAPngEncoder::Encode(&encoded, pixmaps.data(), durations.data(), frameCount,
+                                        encodeOptions);
+        const double encodeTime = SkTime::GetNSecs() - start;
+        sk_sp<SkData> data = encoded.detachAsData();
+
+        std::unique_ptr<SkCodec> codec(ok ? SkCodec::MakeFromData(data) : nullptr);
+        ok = codec && codec->getFrameCount() == frameCount;
+        int mismatched = 0;
+        if (ok) {
+            const std::vector<SkCodec::FrameInfo> frameInfos = codec->getFrameInfo();
+            std::vector<SkBitmap> decoded(frameCount);
+            for (int i = 0; i < frameCount && ok; i++) {
+                decoded[i].allocPixels(info);
+                SkCodec::Options options;
+                options.fFrameIndex = i;
+                options.fPriorFrame = frameInfos[i].fRequiredFrame;
+                if (SkCodec::kNone != options.fPriorFrame) {
+                    decoded[options.fPriorFrame].readPixels(info, decoded[i].getPixels(),
+                                                            decoded[i].rowBytes(), 0, 0);
+                }
+                ok = SkCodec::kSuccess == codec->getPixels(info, decoded[i].getPixels(),
+                                                           decoded[i].rowBytes(), &options)
+                     && frameInfos[i].fDuration == durations[i];
+                for (int y = 0; y < size && ok; y++) {
+                    for (int x = 0; x < size; x++) {
+                        mismatched += *decoded[i].getAddr32(x, y) != *frames[i].getAddr32(x, y);
+                    }
+                }
+            }
+        }
+        ok = ok && !mismatched;
+        failures += ok ? 0 : 1;
+
+        SkString line;
+        line.appendf("{\"name\":\"%s\",\"bytes\":%zu,\"frames\":%d,\"ok\":%s,"
+                     "\"mismatched_pixels\":%d,\"encode_ms\":%.3f}\n",
+                     name.c_str(), data->size(), frameCount, ok ? "true" : "false", mismatched,
+                     encodeTime / 1e6);
+        out->writeText(line.c_str());
+    }
+    return failures;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Fused swizzle + color xform rows
+///////////////////////////////////////////////////////////////////////////////
+
+// A static PNG with a gAMA of 1/1.8, so decoding it to sRGB or linear F16 needs a color xform.
+static sk_sp<SkData> make_gamma_png(int size, int colorType) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr,
+                                                  nullptr);
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    SkDynamicMemoryWStream encoded;
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return nullptr;
+    }
+
+    png_set_write_fn(png_ptr, &encoded, png_write_to_stream, png_flush_stream);
+    png_set_IHDR(png_ptr, info_ptr, size, size, 8, colorType, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_gAMA_fixed(png_ptr, info_ptr, 55556);
+    std::vector<png_color> palette(256);
+    if (PNG_COLOR_TYPE_PALETTE == colorType) {
+        for (int i = 0; i < 256; i++) {
+            palette[i].red = (png_byte)i;
+            palette[i].green = (png_byte)(i * 3);
+            palette[i].blue = (png_byte)(255 - i);
+        }
+        png_set_PLTE(png_ptr, info_ptr, palette.data(), 256);
+    }
+    png_write_info(png_ptr, info_ptr);
+
+    const size_t rowBytes = png_get_rowbytes(png_ptr, info_ptr);
+    std::vector<png_byte> row(rowBytes);
+    for (int y = 0; y < size; y++) {
+        for (size_t x = 0; x < rowBytes; x++) {
+            row[x] = (png_byte)(x * 7 + y * 3);
+        }
+        png_write_row(png_ptr, row.data());
+    }
+    png_write_end(png_ptr, info_ptr);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return encoded.detachAsData();
+}
+
+static double time_decode(const SkData* data, const SkImageInfo& info, SkBitmap* bm,
+                          bool fused, SkExecutor* rowExecutor = nullptr) {
+    std::vector<double> times;
+    for (int loop = 0; loop < FLAGS_loops; loop++) {
+        std::unique_ptr<SkCodec> codec(
+                SkCodec::MakeFromData(sk_ref_sp(const_cast<SkData*>(data))));
+        if (!codec) {
+            return -1;
+        }
+        // Every generated input here is a PNG.
+        SkPngCodec* pngCodec = static_cast<SkPngCodec*>(codec.get());
+        pngCodec->setFusedXformRows(fused);
+        if (rowExecutor) {
+            pngCodec->setRowWorkers(rowExecutor, FLAGS_rowWorkers);
+        }
+        const double start = SkTime::GetNSecs();
+        if (SkCodec::kSuccess != codec->getPixels(info, bm->getPixels(), bm->rowBytes())) {
+            return -1;
+        }
+        times.push_back(SkTime::GetNSecs() - start);
+    }
+    return percentile(times, 0.5);
+}
+
+// Decodes each encoded layout to N32 and F16 with fused xform rows on and off.
+static void bench_xform_rows(SkWStream* out) {
+    static const struct {
+        const char* fName;
+        int         fColorType;
+    } kLayouts[] = {
+        { "rgb8",     PNG_COLOR_TYPE_RGB },
+        { "rgba8",    PNG_COLOR_TYPE_RGB_ALPHA },
+        { "palette8", PNG_COLOR_TYPE_PALETTE },
+        { "gray8",    PNG_COLOR_TYPE_GRAY },
+        { "graya8",   PNG_COLOR_TYPE_GRAY_ALPHA },
+    };
+    const SkImageInfo dstInfos[] = {
+        SkImageInfo::MakeN32Premul(FLAGS_size, FLAGS_size, SkColorSpace::MakeSRGB()),
+        SkImageInfo::Make(FLAGS_size, FLAGS_size, kRGBA_F16_SkColorType, kPremul_SkAlphaType,
+                          SkColorSpace::MakeSRGBLinear()),
+    };
+
+    std::unique_ptr<SkExecutor> rowExecutor;
+    if (FLAGS_rowWorkers > 0) {
+        rowExecutor = SkExecutor::MakeThreadPool(FLAGS_rowWorkers);
+    }
+
+    for (const auto& layout : kLayouts) {
+        sk_sp<SkData> data = make_gamma_png(FLAGS_size, layout.fColorType);
+        for (const SkImageInfo& info : dstInfos) {
+            SkString name;
+            name.printf("xform_%s_%s", layout.fName,
+                        kRGBA_F16_SkColorType == info.colorType() ? "f16" : "n32");
+            if (!data || SkCommandLineFlags::ShouldSkip(FLAGS_match, name.c_str())) {
+                continue;
+            }
+
+            SkBitmap bm;
+            bm.allocPixels(info);
+            const double twoPass = time_decode(data.get(), info, &bm, false);
+            const double fused = time_decode(data.get(), info, &bm, true);
+
+            SkString line;
+            line.appendf("{\"name\":\"%s\",\"rows\":%d,\"ok\":%s,\"two_pass_us\":%.1f,"
+                         "\"fused_us\":%.1f,\"speedup\":%.3f",
+                         name.c_str(), FLAGS_size, twoPass < 0 || fused < 0 ? "false" : "true",
+                         to_us(twoPass), to_us(fused), fused > 0 ? twoPass / fused : 0.0);
+            if (rowExecutor) {
+                const double pipelined = time_decode(data.get(), info, &bm, true,
+                                                     rowExecutor.get());
+                line.appendf(",\"row_workers\":%d,\"pipelined_us\":%.1f", FLAGS_rowWorkers,
+                             to_us(pipelined));
+            }
+            line.append("}\n");
+            out->writeText(line.c_str());
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    SkCommandLineFlags::SetUsage("Benchmarks PNG/APNG decoding over a generated corpus.");
+    SkCommandLineFlags::Parse(argc, argv);
+
+    SkTArray<CorpusEntry> corpus;
+    make_corpus(&corpus);
+    for (int i = 0; i < FLAGS_images.count(); i++) {
+        const char* path = FLAGS_images[i];
+        if (sk_isdir(path)) {
+            SkOSFile::Iter it(path, "png");
+            for (SkString file; it.next(&file); ) {
+                add_file(&corpus, SkOSPath::Join(path, file.c_str()));
+            }
+        } else {
+            add_file(&corpus, SkString(path));
+        }
+    }
+
+    if (!FLAGS_writeCorpus.isEmpty()) {
+        sk_mkdir(FLAGS_writeCorpus[0]);
+        for (const CorpusEntry& entry : corpus) {
+            SkString path = SkOSPath::Join(FLAGS_writeCorpus[0], entry.fName.c_str());
+            if (!path.endsWith(".png")) {
+                path.append(".png");
+            }
+            SkFILEWStream file(path.c_str());
+            file.write(entry.fData->data(), entry.fData->size());
+        }
+    }
+
+    std::unique_ptr<SkWStream> fileOut;
+    SkDebugWStream debugOut;
+    SkWStream* out = &debugOut;
+    if (!FLAGS_json.isEmpty()) {
+        fileOut.reset(new SkFILEWStream(FLAGS_json[0]));
+        out = fileOut.get();
+    }
+
+    std::unique_ptr<SkExecutor> executor;
+    if (FLAGS_threads > 0) {
+        executor = SkExecutor::MakeThreadPool(FLAGS_threads);
+    }
+
+    int failures = 0;
+    for (const CorpusEntry& entry : corpus) {
+        if (SkCommandLineFlags::ShouldSkip(FLAGS_match, entry.fName.c_str())) {
+            continue;
+        }
+        Results results;
+        for (int loop = 0; loop < FLAGS_loops && !results.fFailed; loop++) {
+            bench_once(entry.fData.get(), executor.get(), &results);
+        }
+        failures += results.fFailed ? 1 : 0;
+        report(out, entry, results);
+    }
+    failures += bench_roundtrip(out, executor.get());
+    if (FLAGS_xformRows) {
+        bench_xform_rows(out);
+    }
+    out->flush();
+    return failures ? 1 : 0;
+}